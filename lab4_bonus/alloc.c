@@ -0,0 +1,285 @@
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include "osfs.h"
+
+/*
+ * Inode numbers and data blocks are handed out by the same kind of allocator:
+ * a bitmap searched with next-fit under a spinlock, fronted by a per-CPU
+ * magazine of numbers already reserved in the bitmap. Most allocations and
+ * frees only touch the local magazine; the bitmap lock is taken once per
+ * OSFS_MAGAZINE_BATCH operations to refill or flush it.
+ *
+ * A number sitting in a magazine has its bit set but still counts as free in
+ * nr_free. When the bitmap runs dry, the magazines of all CPUs are drained
+ * back into it before giving up, so -ENOSPC means the allocator really is full.
+ *
+ * Lock order: magazine lock, then allocator lock.
+ */
+
+/**
+ * Function: osfs_find_free_bit
+ * Description: Finds a clear bit in a bitmap with next-fit: the search starts
+ *              at the hint and wraps around to the first usable bit, scanning
+ *              a word at a time.
+ * Inputs:
+ *   - bitmap: The bitmap to search.
+ *   - first: The first bit that may be allocated.
+ *   - size: The number of bits in the bitmap.
+ *   - hint: Where to start searching.
+ * Returns:
+ *   - The number of a clear bit.
+ *   - size if every bit from first on is set.
+ */
+static unsigned long osfs_find_free_bit(const unsigned long *bitmap, unsigned long first,
+                                        unsigned long size, unsigned long hint)
+{
+    unsigned long bit;
+
+    if (hint < first || hint >= size)
+        hint = first;
+
+    bit = find_next_zero_bit(bitmap, size, hint);
+    if (bit < size)
+        return bit;
+    // 後半段都滿了，從頭找到 hint 為止
+    bit = find_next_zero_bit(bitmap, hint, first);
+    return bit < hint ? bit : size;
+}
+
+/**
+ * Function: osfs_allocator_take
+ * Description: Reserves a free number in the bitmap. Called with alloc->lock held.
+ * Inputs:
+ *   - alloc: The allocator.
+ *   - nr: Where to store the reserved number.
+ * Returns:
+ *   - true on success.
+ *   - false if the bitmap is full.
+ */
+static bool osfs_allocator_take(struct osfs_allocator *alloc, uint32_t *nr)
+{
+    unsigned long bit;
+
+    bit = osfs_find_free_bit(alloc->bitmap, alloc->first, alloc->size, alloc->hint);
+    if (bit >= alloc->size)
+        return false;
+
+    __set_bit(bit, alloc->bitmap);
+    // 下次從這個位置後面開始找，連續分配會拿到連續的編號
+    alloc->hint = bit + 1;
+    *nr = bit;
+    return true;
+}
+
+/**
+ * Function: osfs_magazine_refill
+ * Description: Moves up to OSFS_MAGAZINE_BATCH free numbers from the bitmap
+ *              into an empty magazine, arranged so they pop in ascending order.
+ * Inputs:
+ *   - alloc: The allocator.
+ *   - mag: The magazine, locked and empty.
+ * Returns:
+ *   - None.
+ */
+static void osfs_magazine_refill(struct osfs_allocator *alloc, struct osfs_magazine *mag)
+{
+    uint32_t i, n = 0;
+
+    spin_lock(&alloc->lock);
+    while (n < OSFS_MAGAZINE_BATCH && osfs_allocator_take(alloc, &mag->items[n]))
+        n++;
+    spin_unlock(&alloc->lock);
+
+    // 倒過來放，從尾端 pop 出來才會是遞增的編號
+    for (i = 0; i < n / 2; i++)
+        swap(mag->items[i], mag->items[n - 1 - i]);
+    mag->nr = n;
+}
+
+/**
+ * Function: osfs_magazine_flush
+ * Description: Returns the oldest count numbers of a magazine to the bitmap.
+ * Inputs:
+ *   - alloc: The allocator.
+ *   - mag: The magazine, locked.
+ *   - count: How many numbers to return, at most mag->nr.
+ * Returns:
+ *   - None.
+ */
+static void osfs_magazine_flush(struct osfs_allocator *alloc, struct osfs_magazine *mag,
+                                uint32_t count)
+{
+    uint32_t i;
+
+    spin_lock(&alloc->lock);
+    for (i = 0; i < count; i++)
+        __clear_bit(mag->items[i], alloc->bitmap);
+    spin_unlock(&alloc->lock);
+
+    memmove(mag->items, mag->items + count, (mag->nr - count) * sizeof(mag->items[0]));
+    mag->nr -= count;
+}
+
+/**
+ * Function: osfs_allocator_init
+ * Description: Sets up an allocator for the numbers [first, size).
+ * Inputs:
+ *   - alloc: The allocator, zero-filled.
+ *   - first: The first number that may be allocated.
+ *   - size: One past the last number that may be allocated.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails. osfs_allocator_destroy cleans up.
+ */
+int osfs_allocator_init(struct osfs_allocator *alloc, uint32_t first, uint32_t size)
+{
+    int cpu, ret;
+
+    spin_lock_init(&alloc->lock);
+    alloc->first = first;
+    alloc->size = size;
+    alloc->hint = first;
+
+    alloc->bitmap = kvcalloc(BITMAP_SIZE(size), sizeof(unsigned long), GFP_KERNEL);
+    if (!alloc->bitmap)
+        return -ENOMEM;
+
+    alloc->mags = alloc_percpu(struct osfs_magazine);
+    if (!alloc->mags)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        spin_lock_init(&per_cpu_ptr(alloc->mags, cpu)->lock);
+
+    ret = percpu_counter_init(&alloc->nr_free, size - first, GFP_KERNEL);
+    if (ret)
+        return ret;
+    return 0;
+}
+
+/**
+ * Function: osfs_allocator_destroy
+ * Description: Frees everything owned by an allocator. Works on an allocator
+ *              left partially initialized by osfs_allocator_init.
+ * Inputs:
+ *   - alloc: The allocator.
+ * Returns:
+ *   - None.
+ */
+void osfs_allocator_destroy(struct osfs_allocator *alloc)
+{
+    percpu_counter_destroy(&alloc->nr_free);
+    free_percpu(alloc->mags);
+    alloc->mags = NULL;
+    kvfree(alloc->bitmap);
+    alloc->bitmap = NULL;
+}
+
+/**
+ * Function: osfs_allocator_mark_used
+ * Description: Marks a number as allocated while mounting, before any other
+ *              allocation can run.
+ * Inputs:
+ *   - alloc: The allocator.
+ *   - nr: The number to mark.
+ * Returns:
+ *   - None.
+ */
+void osfs_allocator_mark_used(struct osfs_allocator *alloc, uint32_t nr)
+{
+    if (!__test_and_set_bit(nr, alloc->bitmap))
+        percpu_counter_dec(&alloc->nr_free);
+}
+
+/**
+ * Function: osfs_allocator_get
+ * Description: Allocates a number, from the local CPU's magazine when possible.
+ * Inputs:
+ *   - alloc: The allocator.
+ *   - nr: Where to store the allocated number.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if every number is in use.
+ */
+int osfs_allocator_get(struct osfs_allocator *alloc, uint32_t *nr)
+{
+    struct osfs_magazine *mag;
+    bool found = false;
+    int cpu;
+
+    mag = get_cpu_ptr(alloc->mags);
+    spin_lock(&mag->lock);
+    if (!mag->nr)
+        osfs_magazine_refill(alloc, mag);
+    if (mag->nr) {
+        *nr = mag->items[--mag->nr];
+        found = true;
+    }
+    spin_unlock(&mag->lock);
+    put_cpu_ptr(alloc->mags);
+
+    if (!found) {
+        // bitmap 空了，但其他 CPU 的 magazine 可能還留著可用的編號
+        for_each_possible_cpu(cpu) {
+            mag = per_cpu_ptr(alloc->mags, cpu);
+            spin_lock(&mag->lock);
+            if (mag->nr)
+                osfs_magazine_flush(alloc, mag, mag->nr);
+            spin_unlock(&mag->lock);
+        }
+
+        spin_lock(&alloc->lock);
+        found = osfs_allocator_take(alloc, nr);
+        spin_unlock(&alloc->lock);
+        if (!found)
+            return -ENOSPC;
+    }
+
+    percpu_counter_dec(&alloc->nr_free);
+    return 0;
+}
+
+/**
+ * Function: osfs_allocator_put
+ * Description: Frees a number into the local CPU's magazine. A full magazine
+ *              first returns half of its numbers to the bitmap.
+ * Inputs:
+ *   - alloc: The allocator.
+ *   - nr: The number to free.
+ * Returns:
+ *   - None.
+ */
+void osfs_allocator_put(struct osfs_allocator *alloc, uint32_t nr)
+{
+    struct osfs_magazine *mag;
+
+    mag = get_cpu_ptr(alloc->mags);
+    spin_lock(&mag->lock);
+    if (mag->nr == OSFS_MAGAZINE_SIZE)
+        osfs_magazine_flush(alloc, mag, OSFS_MAGAZINE_BATCH);
+    mag->items[mag->nr++] = nr;
+    spin_unlock(&mag->lock);
+    put_cpu_ptr(alloc->mags);
+
+    percpu_counter_inc(&alloc->nr_free);
+}
+
+/**
+ * Function: osfs_allocator_load
+ * Description: Replaces the allocation state with a saved bitmap while
+ *              mounting, before any other allocation can run.
+ * Inputs:
+ *   - alloc: The allocator, with empty magazines.
+ *   - words: The saved bitmap as 64-bit words in host byte order.
+ * Returns:
+ *   - None.
+ */
+void osfs_allocator_load(struct osfs_allocator *alloc, const u64 *words)
+{
+    bitmap_from_arr64(alloc->bitmap, words, alloc->size);
+    // first 之前的編號不會被分配，不管存檔裡寫了什麼都清掉
+    bitmap_clear(alloc->bitmap, 0, alloc->first);
+    alloc->hint = alloc->first;
+    percpu_counter_set(&alloc->nr_free,
+                       alloc->size - alloc->first - bitmap_weight(alloc->bitmap, alloc->size));
+}
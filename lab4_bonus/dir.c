@@ -3,6 +3,270 @@
 #include <linux/slab.h>
 #include "osfs.h"
 
+/**
+ * Function: osfs_dir_block
+ * Description: Returns the memory of a block of a directory.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - dir_inode: The osfs_inode of the directory.
+ *   - block: The logical block number within the directory.
+ * Returns:
+ *   - A pointer to the block's memory.
+ *   - NULL if the block is not allocated.
+ */
+static void *osfs_dir_block(struct osfs_sb_info *sb_info, struct osfs_inode *dir_inode, uint32_t block)
+{
+    uint32_t block_no, mapped;
+
+    down_read(&dir_inode->i_extent_sem);
+    mapped = osfs_extent_lookup(dir_inode, block, &block_no, NULL);
+    up_read(&dir_inode->i_extent_sem);
+
+    if (!mapped)
+        return NULL;
+    return osfs_block_addr(sb_info, block_no);
+}
+
+/**
+ * Function: osfs_dir_block_dirty
+ * Description: Records that a directory block was modified, for the next
+ *              journal commit. Directory blocks only change between
+ *              osfs_meta_begin and osfs_meta_end, when no commit or checkpoint
+ *              runs, so it does not matter whether this comes before or after
+ *              the change.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - dir_inode: The osfs_inode of the directory.
+ *   - pos: A byte offset within the block.
+ * Returns:
+ *   - None.
+ */
+static void osfs_dir_block_dirty(struct osfs_sb_info *sb_info, struct osfs_inode *dir_inode,
+                                 uint32_t pos)
+{
+    uint32_t block_no, mapped;
+
+    if (!sb_info->image)
+        return;
+
+    down_read(&dir_inode->i_extent_sem);
+    mapped = osfs_extent_lookup(dir_inode, pos / sb_info->block_size, &block_no, NULL);
+    up_read(&dir_inode->i_extent_sem);
+    if (mapped)
+        osfs_image_log_block(sb_info, block_no);
+}
+
+/**
+ * Function: osfs_dir_entry_at
+ * Description: Returns the directory record starting at a byte offset of a directory.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - dir_inode: The osfs_inode of the directory.
+ *   - pos: The byte offset of the record.
+ * Returns:
+ *   - A pointer to the directory record.
+ *   - NULL if the block holding the record is not allocated.
+ */
+static struct osfs_dir_entry *osfs_dir_entry_at(struct osfs_sb_info *sb_info,
+                                                struct osfs_inode *dir_inode, uint32_t pos)
+{
+    void *block_data = osfs_dir_block(sb_info, dir_inode, pos / sb_info->block_size);
+
+    if (!block_data)
+        return NULL;
+    return block_data + pos % sb_info->block_size;
+}
+
+// Bytes of a record taken up by its header and name
+static inline uint32_t osfs_dir_rec_used(const struct osfs_dir_entry *entry)
+{
+    return entry->inode_no ? OSFS_DIR_REC_LEN(entry->name_len) : 0;
+}
+
+/**
+ * Function: osfs_dir_rec_valid
+ * Description: Checks a record read from a directory block before it is
+ *              used: its header, rec_len and name must lie inside the block.
+ *              The header is only read once it is known to fit.
+ * Inputs:
+ *   - block_data: The memory of the block.
+ *   - offset: The byte offset of the record in the block.
+ *   - block_size: The size of the block.
+ * Returns:
+ *   - true if the record is well formed.
+ *   - false if the block is corrupted.
+ */
+static bool osfs_dir_rec_valid(void *block_data, uint32_t offset, uint32_t block_size)
+{
+    struct osfs_dir_entry *entry = block_data + offset;
+
+    if (block_size - offset < OSFS_DIR_REC_LEN(0))
+        return false;
+    return entry->rec_len >= OSFS_DIR_REC_LEN(0) && entry->rec_len % OSFS_DIR_ALIGN == 0 &&
+           entry->rec_len <= block_size - offset && entry->rec_len >= osfs_dir_rec_used(entry);
+}
+
+/**
+ * Function: osfs_dir_block_room
+ * Description: Finds the largest record a directory block can take without
+ *              moving any of its records: the free bytes after the name of a
+ *              used record, or the whole of an unused one.
+ * Inputs:
+ *   - block_data: The memory of the block.
+ *   - block_size: The size of the block.
+ * Returns:
+ *   - The size of the largest gap in bytes.
+ */
+static uint32_t osfs_dir_block_room(void *block_data, uint32_t block_size)
+{
+    struct osfs_dir_entry *entry;
+    uint32_t pos, room = 0;
+
+    for (pos = 0; pos < block_size; pos += entry->rec_len) {
+        entry = block_data + pos;
+        room = max_t(uint32_t, room, entry->rec_len - osfs_dir_rec_used(entry));
+    }
+    return room;
+}
+
+/**
+ * Function: osfs_dir_init_block
+ * Description: Formats a new directory block as a single unused record.
+ * Inputs:
+ *   - block_data: The memory of the block.
+ *   - block_size: The size of the block.
+ * Returns:
+ *   - None.
+ */
+static void osfs_dir_init_block(void *block_data, uint32_t block_size)
+{
+    struct osfs_dir_entry *entry = block_data;
+
+    entry->inode_no = 0;
+    entry->name_hash = 0;
+    entry->rec_len = block_size;
+    entry->name_len = 0;
+    entry->file_type = DT_UNKNOWN;
+}
+
+/**
+ * Function: osfs_dir_get_index
+ * Description: Returns the hash index of a directory, building it from the
+ *              directory blocks on first use. The largest gap of every block
+ *              is recorded on the way. Called without i_dir_sem held: the
+ *              index is built under i_dir_sem and lives as long as the
+ *              in-memory inode of the directory.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - dir: The inode of the directory.
+ * Returns:
+ *   - A pointer to the directory's hash index.
+ *   - ERR_PTR(-ENOMEM) if the index cannot be allocated.
+ *   - ERR_PTR(-EIO) if a directory block is missing or corrupted.
+ */
+static struct osfs_dir_index *osfs_dir_get_index(struct osfs_sb_info *sb_info, struct inode *dir)
+{
+    struct osfs_inode_info *info = OSFS_I(dir);
+    struct osfs_inode *dir_inode = info->i_raw;
+    struct osfs_dir_index *index;
+    struct osfs_dir_entry *entry;
+    uint32_t block, nr_blocks, offset, room;
+    void *block_data;
+    int ret = 0;
+
+    index = smp_load_acquire(&info->i_dir_index);
+    if (index)
+        return index;
+
+    down_write(&info->i_dir_sem);
+    // 可能有別人先建好了
+    index = info->i_dir_index;
+    if (index)
+        goto out_unlock;
+
+    index = osfs_dir_index_create();
+    if (!index) {
+        index = ERR_PTR(-ENOMEM);
+        goto out_unlock;
+    }
+
+    nr_blocks = dir_inode->i_size / sb_info->block_size;
+    for (block = 0; block < nr_blocks && !ret; block++) {
+        block_data = osfs_dir_block(sb_info, dir_inode, block);
+        if (!block_data) {
+            ret = -EIO;
+            break;
+        }
+
+        room = 0;
+        for (offset = 0; offset < sb_info->block_size && !ret; offset += entry->rec_len) {
+            entry = block_data + offset;
+            if (!osfs_dir_rec_valid(block_data, offset, sb_info->block_size)) {
+                pr_err("osfs_dir_get_index: Corrupted entry in inode %u block %u\n",
+                       dir_inode->i_ino, block);
+                ret = -EIO;
+                break;
+            }
+            room = max_t(uint32_t, room, entry->rec_len - osfs_dir_rec_used(entry));
+            if (entry->inode_no)
+                ret = osfs_dir_index_add(index, entry->name_hash,
+                                         block * sb_info->block_size + offset);
+        }
+        if (!ret)
+            ret = osfs_dir_index_set_free(index, block, room);
+    }
+    if (ret) {
+        osfs_dir_index_destroy(index);
+        index = ERR_PTR(ret);
+        goto out_unlock;
+    }
+
+    smp_store_release(&info->i_dir_index, index);
+out_unlock:
+    up_write(&info->i_dir_sem);
+    return index;
+}
+
+/**
+ * Function: osfs_find_dir_entry
+ * Description: Finds the entry with a given name in a directory through its
+ *              hash index. Called with i_dir_sem held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - dir: The inode of the directory.
+ *   - index: The hash index of the directory.
+ *   - name: The name to look for.
+ *   - name_len: The length of the name.
+ *   - hash: full_name_hash() of the name.
+ *   - pos: Where to store the byte offset of the entry, may be NULL.
+ * Returns:
+ *   - A pointer to the directory entry if found.
+ *   - NULL if no entry has that name.
+ */
+static struct osfs_dir_entry *osfs_find_dir_entry(struct osfs_sb_info *sb_info,
+                                                  struct inode *dir,
+                                                  struct osfs_dir_index *index,
+                                                  const char *name, size_t name_len,
+                                                  uint32_t hash, uint32_t *pos)
+{
+    struct osfs_dir_index_entry *index_entry;
+    struct osfs_dir_entry *entry;
+
+    lockdep_assert_held(&OSFS_I(dir)->i_dir_sem);
+
+    // 只比對 hash 相同的項目，先比長度再比字串
+    osfs_dir_index_for_each_possible(index, index_entry, hash) {
+        entry = osfs_dir_entry_at(sb_info, OSFS_I(dir)->i_raw, index_entry->pos);
+        if (entry && entry->inode_no && entry->name_len == name_len &&
+            memcmp(entry->filename, name, name_len) == 0) {
+            if (pos)
+                *pos = index_entry->pos;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
 /**
  * Function: osfs_lookup
  * Description: Looks up a file within a directory.
@@ -17,38 +281,40 @@
 static struct dentry *osfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
     struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
-    struct osfs_inode *parent_inode = dir->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
+    struct osfs_dir_index *index;
+    struct osfs_dir_entry *entry;
     struct inode *inode = NULL;
+    uint32_t ino = 0;
 
     pr_info("osfs_lookup: Looking up '%.*s' in inode %lu\n",
             (int)dentry->d_name.len, dentry->d_name.name, dir->i_ino);
 
-    // Read the parent directory's data block
-    dir_data_block = sb_info->data_blocks + parent_inode->i_block * BLOCK_SIZE;
-
-    // Calculate the number of directory entries
-    dir_entry_count = parent_inode->i_size / sizeof(struct osfs_dir_entry);
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
-
-    // Traverse the directory entries to find a matching filename
-    for (i = 0; i < dir_entry_count; i++) {
-        if (strlen(dir_entries[i].filename) == dentry->d_name.len &&
-            strncmp(dir_entries[i].filename, dentry->d_name.name, dentry->d_name.len) == 0) {
-            // File found, get inode
-            inode = osfs_iget(dir->i_sb, dir_entries[i].inode_no);
-            if (IS_ERR(inode)) {
-                pr_err("osfs_lookup: Error getting inode %u\n", dir_entries[i].inode_no);
-                return ERR_CAST(inode);
-            }
-            return d_splice_alias(inode, dentry);
-        }
-    }
+    if (dentry->d_name.len > MAX_FILENAME_LEN)
+        return ERR_PTR(-ENAMETOOLONG);
 
-    return NULL;
+    index = osfs_dir_get_index(sb_info, dir);
+    if (IS_ERR(index))
+        return ERR_CAST(index);
+
+    // lookup 只拿到 i_rwsem 的 shared lock，可能和別的 lookup 同時進行
+    down_read(&OSFS_I(dir)->i_dir_sem);
+    entry = osfs_find_dir_entry(sb_info, dir, index,
+                                dentry->d_name.name, dentry->d_name.len,
+                                full_name_hash(NULL, dentry->d_name.name, dentry->d_name.len),
+                                NULL);
+    if (entry)
+        ino = entry->inode_no;
+    up_read(&OSFS_I(dir)->i_dir_sem);
+    if (!ino)
+        return NULL;
+
+    // File found, get inode
+    inode = osfs_iget(dir->i_sb, ino);
+    if (IS_ERR(inode)) {
+        pr_err("osfs_lookup: Error getting inode %u\n", ino);
+        return ERR_CAST(inode);
+    }
+    return d_splice_alias(inode, dentry);
 }
 
 /**
@@ -65,37 +331,53 @@ static int osfs_iterate(struct file *filp, struct dir_context *ctx)
 {
     struct inode *inode = file_inode(filp);
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
-    struct osfs_inode *osfs_inode = inode->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    uint32_t block_size = sb_info->block_size;
+    struct osfs_dir_entry *entry;
+    uint32_t block, offset;
+    void *block_data;
+    int ret = 0;
 
     if (ctx->pos == 0) {
         if (!dir_emit_dots(filp, ctx))
             return 0;
     }
 
-    dir_data_block = sb_info->data_blocks + osfs_inode->i_block * BLOCK_SIZE;
-    dir_entry_count = osfs_inode->i_size / sizeof(struct osfs_dir_entry);
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
-
-    /* Adjust the index based on ctx->pos */
-    i = ctx->pos - 2;
+    down_read(&OSFS_I(inode)->i_dir_sem);
+    /* ctx->pos is the byte offset of the next record, plus 2 for "." and ".." */
+    while (ctx->pos - 2 < osfs_inode->i_size) {
+        block = (ctx->pos - 2) / block_size;
+        block_data = osfs_dir_block(sb_info, osfs_inode, block);
+        if (!block_data) {
+            ret = -EIO;
+            goto out;
+        }
 
-    for (; i < dir_entry_count; i++) {
-        struct osfs_dir_entry *entry = &dir_entries[i];
-        unsigned int type = DT_UNKNOWN;
+        // 刪掉的 record 會併進前一個，舊的位置可能落在 record 中間，從 block 開頭找到下一個 record
+        for (offset = 0; offset < block_size; offset += entry->rec_len) {
+            entry = block_data + offset;
+            // 目錄 block 來自 image，rec_len 和 name_len 都要先檢查過才能用
+            if (!osfs_dir_rec_valid(block_data, offset, block_size)) {
+                pr_err("osfs_iterate: Corrupted entry in inode %lu block %u\n",
+                       inode->i_ino, block);
+                ret = -EIO;
+                goto out;
+            }
+            if (block * block_size + offset < ctx->pos - 2)
+                continue;
 
-        if (!dir_emit(ctx, entry->filename, strlen(entry->filename), entry->inode_no, type)) {
-            pr_err("osfs_iterate: dir_emit failed for entry '%s'\n", entry->filename);
-            return -EINVAL;
+            ctx->pos = 2 + block * block_size + offset;
+            // 空的 record 跳過
+            if (entry->inode_no &&
+                !dir_emit(ctx, entry->filename, entry->name_len, entry->inode_no, entry->file_type))
+                goto out;
         }
-
-        ctx->pos++;
+        ctx->pos = 2 + (block + 1) * block_size;
     }
 
-    return 0;
+out:
+    up_read(&OSFS_I(inode)->i_dir_sem);
+    return ret;
 }
 
 /**
@@ -107,7 +389,7 @@ static int osfs_iterate(struct file *filp, struct dir_context *ctx)
  * Returns:
  *   - A pointer to the newly created inode on success.
  *   - ERR_PTR(-EINVAL) if the file type is not supported.
- *   - ERR_PTR(-ENOSPC) if there are no free inodes or blocks.
+ *   - ERR_PTR(-ENOSPC) if there are no free inodes.
  *   - ERR_PTR(-ENOMEM) if memory allocation fails.
  *   - ERR_PTR(-EIO) if an I/O error occurs.
  */
@@ -117,7 +399,7 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     struct osfs_sb_info *sb_info = sb->s_fs_info;
     struct inode *inode;
     struct osfs_inode *osfs_inode;
-    int ino, ret;
+    int ino;
 
     /* Check if the mode is supported */
     if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
@@ -125,10 +407,6 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
         return ERR_PTR(-EINVAL);
     }
 
-    /* Check if there are free inodes and blocks */
-    if (sb_info->nr_free_inodes == 0 || sb_info->nr_free_blocks == 0)
-        return ERR_PTR(-ENOSPC);
-
     /* Allocate a new inode number */
     ino = osfs_get_free_inode(sb_info);
     if (ino < 0 || ino >= sb_info->inode_count)
@@ -136,8 +414,10 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
 
     /* Allocate a new VFS inode */
     inode = new_inode(sb);
-    if (!inode)
+    if (!inode) {
+        osfs_allocator_put(&sb_info->inode_alloc, ino);
         return ERR_PTR(-ENOMEM);
+    }
 
     /* Initialize inode owner and permissions */
     inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
@@ -155,6 +435,7 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     } else if (S_ISREG(mode)) {
         inode->i_op = &osfs_file_inode_operations;
         inode->i_fop = &osfs_file_operations;
+        inode->i_mapping->a_ops = osfs_file_aops(sb);
         set_nlink(inode, 1);
         inode->i_size = 0;
     } else if (S_ISLNK(mode)) {
@@ -170,73 +451,311 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
         iput(inode);
         return ERR_PTR(-EIO);
     }
-    memset(osfs_inode, 0, sizeof(*osfs_inode));
-
     /* Initialize osfs_inode */
-    osfs_inode->i_ino = ino;
+    osfs_init_osfs_inode(osfs_inode, ino);
     osfs_inode->i_mode = inode->i_mode;
+    osfs_inode->i_links_count = inode->i_nlink;
     osfs_inode->i_uid = i_uid_read(inode);
     osfs_inode->i_gid = i_gid_read(inode);
     osfs_inode->i_size = inode->i_size;
     osfs_inode->i_blocks = 0; // BONUS 初始時不佔用任何 block
     osfs_inode->__i_atime = osfs_inode->__i_mtime = osfs_inode->__i_ctime = current_time(inode);
-    inode->i_private = osfs_inode;
+    OSFS_I(inode)->i_raw = osfs_inode;
+    // 放進 inode hash，之後 osfs_iget 才會找到同一個 VFS inode
+    insert_inode_hash(inode);
 
-    // [BONUS] 初始化 blocks 陣列為 0
-    memset(osfs_inode->blocks, 0, sizeof(osfs_inode->blocks));
-    inode->i_private = osfs_inode;
+    // [BONUS] memset 之後 extent map 是空的，整個檔案都是 hole
 
     // [BONUS] 移除原本在這裡的 osfs_alloc_data_block 呼叫
     // 我們改成「延遲分配」(Lazy Allocation)，寫入時再要空間，這樣比較靈活
+    // 目錄也一樣，新增目錄項目時才分配 block
 
-    /* Update superblock information */
-    sb_info->nr_free_inodes--;
-
-    /* Mark inode as dirty */
-    mark_inode_dirty(inode);
+    /* Mark inode as dirty; the VFS inode is marked by the caller after osfs_meta_end */
+    osfs_image_dirty_inode(sb_info, ino);
 
     return inode;
 }
 
-static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, const char *name, size_t name_len)
+/**
+ * Function: osfs_dir_take_room
+ * Description: Carves a record of rec_len bytes out of the free space of a
+ *              directory block, either by reusing an unused record or by
+ *              splitting the slack off the end of a used one.
+ * Inputs:
+ *   - block_data: The memory of the block.
+ *   - block_size: The size of the block.
+ *   - rec_len: The number of bytes needed.
+ *   - offset: Where to store the offset of the new record in the block.
+ * Returns:
+ *   - A pointer to the new record, with rec_len set and everything else unset.
+ *   - NULL if no single gap in the block is large enough.
+ */
+static struct osfs_dir_entry *osfs_dir_take_room(void *block_data, uint32_t block_size,
+                                                 uint32_t rec_len, uint32_t *offset)
 {
-    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
-    struct osfs_inode *parent_inode = dir->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
-
-    // Read the parent directory's data block
-    dir_data_block = sb_info->data_blocks + parent_inode->i_block * BLOCK_SIZE;
-
-    // Calculate the existing number of directory entries
-    dir_entry_count = parent_inode->i_size / sizeof(struct osfs_dir_entry);
-    if (dir_entry_count >= MAX_DIR_ENTRIES) {
-        pr_err("osfs_add_dir_entry: Parent directory is full\n");
-        return -ENOSPC;
+    struct osfs_dir_entry *entry, *new_entry;
+    uint32_t pos, used;
+
+    for (pos = 0; pos < block_size; pos += entry->rec_len) {
+        entry = block_data + pos;
+        used = osfs_dir_rec_used(entry);
+        if (entry->rec_len - used < rec_len)
+            continue;
+
+        *offset = pos + used;
+        if (used == 0)
+            return entry;
+        new_entry = block_data + pos + used;
+        new_entry->rec_len = entry->rec_len - used;
+        entry->rec_len = used;
+        return new_entry;
     }
+    return NULL;
+}
+
+/**
+ * Function: osfs_add_dir_entry
+ * Description: Adds a name to a directory, refusing duplicates. The record
+ *              goes into a gap of a block that has room for it; a new block is
+ *              added only when no block has a large enough gap. Records
+ *              already in the directory never move, so a readdir in progress
+ *              sees each of them.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - inode_no: The inode number the new entry points to.
+ *   - mode: The mode of that inode, recorded as the entry's file type.
+ *   - name: The name of the new entry.
+ *   - name_len: The length of the name.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENAMETOOLONG if the name is longer than MAX_FILENAME_LEN.
+ *   - -EEXIST if the directory already has an entry with that name.
+ *   - -ENOSPC if the directory needs a new block and none is free.
+ *   - -ENOMEM if the hash index cannot be updated.
+ *   - -EIO if a directory block is missing or corrupted.
+ */
+static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, umode_t mode,
+                              const char *name, size_t name_len)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct osfs_inode *parent_inode = OSFS_I(dir)->i_raw;
+    uint32_t block_size = sb_info->block_size;
+    uint32_t rec_len = OSFS_DIR_REC_LEN(name_len);
+    struct osfs_dir_index *index;
+    struct osfs_dir_entry *entry;
+    uint32_t hash, block, offset, block_no;
+    void *block_data;
+    int ret;
+
+    if (name_len > MAX_FILENAME_LEN)
+        return -ENAMETOOLONG;
 
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
+    index = osfs_dir_get_index(sb_info, dir);
+    if (IS_ERR(index))
+        return PTR_ERR(index);
+
+    down_write(&OSFS_I(dir)->i_dir_sem);
 
     // Check if a file with the same name exists
-    for (i = 0; i < dir_entry_count; i++) {
-        if (strlen(dir_entries[i].filename) == name_len &&
-            strncmp(dir_entries[i].filename, name, name_len) == 0) {
-            pr_warn("osfs_add_dir_entry: File '%.*s' already exists\n", (int)name_len, name);
-            return -EEXIST;
+    hash = full_name_hash(NULL, name, name_len);
+    if (osfs_find_dir_entry(sb_info, dir, index, name, name_len, hash, NULL)) {
+        pr_warn("osfs_add_dir_entry: File '%.*s' already exists\n", (int)name_len, name);
+        ret = -EEXIST;
+        goto out_unlock;
+    }
+
+    if (osfs_dir_index_find_room(index, rec_len, &block)) {
+        block_data = osfs_dir_block(sb_info, parent_inode, block);
+        if (!block_data) {
+            ret = -EIO;
+            goto out_unlock;
+        }
+        // index 記的是最大的空隙，一定放得下
+        entry = osfs_dir_take_room(block_data, block_size, rec_len, &offset);
+        if (!entry) {
+            ret = -EIO;
+            goto out_unlock;
         }
+    } else {
+        // 沒有 block 放得下，替目錄分配下一個 block
+        block = parent_inode->i_size / block_size;
+        if (parent_inode->i_size + block_size > U32_MAX) {
+            ret = -ENOSPC;
+            goto out_unlock;
+        }
+        ret = osfs_dir_index_set_free(index, block, 0);
+        if (ret)
+            goto out_unlock;
+        down_write(&parent_inode->i_extent_sem);
+        ret = osfs_map_new_block(sb_info, parent_inode, block, 0, &block_no);
+        up_write(&parent_inode->i_extent_sem);
+        if (ret)
+            goto out_unlock;
+        block_data = osfs_block_addr(sb_info, block_no);
+        osfs_dir_init_block(block_data, block_size);
+        entry = osfs_dir_take_room(block_data, block_size, rec_len, &offset);
+
+        parent_inode->i_size += block_size;
+        i_size_write(dir, parent_inode->i_size);
+        osfs_set_i_blocks(dir, parent_inode);
+        index->last_block = block;
+    }
+
+    osfs_dir_block_dirty(sb_info, parent_inode, block * block_size);
+    ret = osfs_dir_index_add(index, hash, block * block_size + offset);
+    if (ret) {
+        // 留下一個空的 record，block 格式仍然正確
+        entry->inode_no = 0;
+        entry->name_len = 0;
+        osfs_dir_index_set_free(index, block, osfs_dir_block_room(block_data, block_size));
+        goto out_unlock;
     }
 
     // Add a new directory entry
-    strncpy(dir_entries[dir_entry_count].filename, name, name_len);
-    dir_entries[dir_entry_count].filename[name_len] = '\0';
-    dir_entries[dir_entry_count].inode_no = inode_no;
+    entry->inode_no = inode_no;
+    entry->name_hash = hash;
+    entry->name_len = name_len;
+    entry->file_type = fs_umode_to_dtype(mode);
+    memcpy(entry->filename, name, name_len);
+    // block 已經在 index 裡，set_free 不需要配置記憶體，不會失敗
+    osfs_dir_index_set_free(index, block, osfs_dir_block_room(block_data, block_size));
 
-    // Update the size of the parent directory
-    parent_inode->i_size += sizeof(struct osfs_dir_entry);
+out_unlock:
+    up_write(&OSFS_I(dir)->i_dir_sem);
+    return ret;
+}
 
-    return 0;
+
+/**
+ * Function: osfs_remove_dir_entry
+ * Description: Removes a name from a directory. The record is merged into
+ *              the one before it in its block, or marked unused if it is the
+ *              first, so no other record moves. The gaps left behind are
+ *              recorded in the index, where osfs_add_dir_entry finds them.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - name: The name to remove.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if the directory has no entry with that name.
+ *   - -ENOMEM or -EIO if the hash index cannot be built.
+ */
+static int osfs_remove_dir_entry(struct inode *dir, const struct qstr *name)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    uint32_t block_size = sb_info->block_size;
+    struct osfs_dir_entry *entry, *prev = NULL;
+    uint32_t hash, pos, block, offset, cur;
+    struct osfs_dir_index *index;
+    void *block_data;
+    int ret = 0;
+
+    index = osfs_dir_get_index(sb_info, dir);
+    if (IS_ERR(index))
+        return PTR_ERR(index);
+
+    down_write(&OSFS_I(dir)->i_dir_sem);
+    hash = full_name_hash(NULL, name->name, name->len);
+    entry = osfs_find_dir_entry(sb_info, dir, index, name->name, name->len, hash, &pos);
+    if (!entry) {
+        ret = -ENOENT;
+        goto out_unlock;
+    }
+
+    block = pos / block_size;
+    offset = pos % block_size;
+    block_data = (void *)entry - offset;
+    for (cur = 0; cur < offset; cur += prev->rec_len)
+        prev = block_data + cur;
+
+    osfs_dir_index_del(index, hash, pos);
+    // 併進前一個 record 變成它的空隙；block 的第一個 record 只能標成沒有用
+    if (prev) {
+        prev->rec_len += entry->rec_len;
+    } else {
+        entry->inode_no = 0;
+        entry->name_len = 0;
+    }
+    // block 已經在 index 裡，set_free 不需要配置記憶體，不會失敗
+    osfs_dir_index_set_free(index, block, osfs_dir_block_room(block_data, block_size));
+    osfs_dir_block_dirty(sb_info, OSFS_I(dir)->i_raw, pos);
+
+out_unlock:
+    up_write(&OSFS_I(dir)->i_dir_sem);
+    return ret;
+}
+
+/**
+ * Function: osfs_retarget_dir_entry
+ * Description: Points an existing name of a directory at another inode, in
+ *              place. Used by rename, which then cannot fail for lack of space.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - name: The name to change.
+ *   - inode: The inode the name should point to.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if the directory has no entry with that name.
+ *   - -ENOMEM or -EIO if the hash index cannot be built.
+ */
+static int osfs_retarget_dir_entry(struct inode *dir, const struct qstr *name, struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct osfs_dir_index *index;
+    struct osfs_dir_entry *entry;
+    uint32_t pos;
+    int ret = 0;
+
+    index = osfs_dir_get_index(sb_info, dir);
+    if (IS_ERR(index))
+        return PTR_ERR(index);
+
+    down_write(&OSFS_I(dir)->i_dir_sem);
+    entry = osfs_find_dir_entry(sb_info, dir, index, name->name, name->len,
+                                full_name_hash(NULL, name->name, name->len), &pos);
+    if (entry) {
+        entry->inode_no = inode->i_ino;
+        entry->file_type = fs_umode_to_dtype(inode->i_mode);
+        osfs_dir_block_dirty(sb_info, OSFS_I(dir)->i_raw, pos);
+    } else {
+        ret = -ENOENT;
+    }
+    up_write(&OSFS_I(dir)->i_dir_sem);
+    return ret;
+}
+
+/**
+ * Function: osfs_dir_check_empty
+ * Description: Checks that a directory has no entries besides "." and "..".
+ * Inputs:
+ *   - dir: The inode of the directory.
+ * Returns:
+ *   - 0 if the directory is empty.
+ *   - -ENOTEMPTY if it is not.
+ *   - -ENOMEM or -EIO if the hash index cannot be built.
+ */
+static int osfs_dir_check_empty(struct inode *dir)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct osfs_dir_index *index;
+    bool empty;
+
+    index = osfs_dir_get_index(sb_info, dir);
+    if (IS_ERR(index))
+        return PTR_ERR(index);
+
+    down_read(&OSFS_I(dir)->i_dir_sem);
+    empty = index->count == 0;
+    up_read(&OSFS_I(dir)->i_dir_sem);
+    return empty ? 0 : -ENOTEMPTY;
+}
+
+// Keeps the link count in the inode table in step with the VFS inode
+static void osfs_sync_nlink(struct inode *inode)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+
+    osfs_inode->i_links_count = inode->i_nlink;
 }
 
 
@@ -259,27 +778,30 @@ static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, const char *
 static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
 {   
     // Step1: Parse the parent directory passed by the VFS 
-    struct osfs_inode *parent_inode = dir->i_private;
+    struct osfs_inode *parent_inode = OSFS_I(dir)->i_raw;
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
     struct osfs_inode *osfs_inode;
     struct inode *inode;
     int ret;
 
     // Step2: Validate the file name length
     // 呼叫我們已經有的 osfs_new_inode 來取得一個新的 Inode
+    osfs_meta_begin(sb_info);
     inode = osfs_new_inode(dir, mode);
     if (IS_ERR(inode)){
+        osfs_meta_end(sb_info);
         return PTR_ERR(inode);
     }
 
     // Step3: Allocate and initialize VFS & osfs inode
-    osfs_inode = inode->i_private;
+    osfs_inode = OSFS_I(inode)->i_raw;
     if (!osfs_inode) {
         pr_err("osfs_create: Failed to get osfs_inode for inode %lu\n", inode->i_ino);
+        osfs_meta_end(sb_info);
         iput(inode);
         return -EIO;
     }
     // init osfs_inode attribute
-    osfs_inode->i_block = 0; 
     osfs_inode->i_size = 0;
     osfs_inode->i_blocks = 0;
     // 同步 VFS inode 的大小
@@ -287,9 +809,12 @@ static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry
 
     // Step4: Parent directory entry update for the new file
     // 將 "檔名" 與 "Inode 號碼" 寫入父目錄的 Data Block 中
-    ret = osfs_add_dir_entry(dir, inode->i_ino, dentry->d_name.name, dentry->d_name.len);
+    ret = osfs_add_dir_entry(dir, inode->i_ino, inode->i_mode, dentry->d_name.name, dentry->d_name.len);
     if (ret) {
         pr_err("osfs_create: Failed to add directory entry\n");
+        // 還沒有名字指向它，讓 evict 把 inode 收回；evict 自己會進 meta，要先離開
+        clear_nlink(inode);
+        osfs_meta_end(sb_info);
         iput(inode);
         return ret;
     }
@@ -298,7 +823,10 @@ static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry
     // 因為父目錄新增了一個項目，所以要更新修改時間 (mtime) 和改變時間 (ctime)
     inode_set_mtime_to_ts(dir, current_time(dir));
     inode_set_ctime_to_ts(dir, current_time(dir));
-    mark_inode_dirty(dir); // 標記為 dirty，通知系統需要同步
+    osfs_meta_end(sb_info);
+    // 標記為 dirty，通知系統需要同步；osfs_dirty_inode 自己會進 meta
+    mark_inode_dirty(dir);
+    mark_inode_dirty(inode);
     
     // Step 6: Bind the inode to the VFS dentry
     d_instantiate(dentry, inode);
@@ -310,14 +838,249 @@ static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry
 
 
 
+/**
+ * Function: osfs_mkdir
+ * Description: Creates a new directory within a directory.
+ * Inputs:
+ *   - idmap: The mount namespace ID map.
+ *   - dir: The inode of the parent directory.
+ *   - dentry: The dentry representing the new directory.
+ *   - mode: The permissions of the new directory.
+ * Returns:
+ *   - 0 on successful creation.
+ *   - A negative error code from osfs_new_inode or osfs_add_dir_entry on failure.
+ */
+static int osfs_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct inode *inode;
+    int ret;
+
+    osfs_meta_begin(sb_info);
+    inode = osfs_new_inode(dir, mode | S_IFDIR);
+    if (IS_ERR(inode)) {
+        osfs_meta_end(sb_info);
+        return PTR_ERR(inode);
+    }
+
+    ret = osfs_add_dir_entry(dir, inode->i_ino, inode->i_mode, dentry->d_name.name, dentry->d_name.len);
+    if (ret) {
+        clear_nlink(inode);
+        osfs_meta_end(sb_info);
+        iput(inode);
+        return ret;
+    }
+
+    // 新目錄的 ".." 指向父目錄
+    inc_nlink(dir);
+    osfs_sync_nlink(dir);
+    inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
+    osfs_meta_end(sb_info);
+    mark_inode_dirty(dir);
+    mark_inode_dirty(inode);
+    d_instantiate(dentry, inode);
+    return 0;
+}
+
+// Removes the name of dentry and drops a link; shared by unlink and rmdir, which
+// mark both inodes dirty after osfs_meta_end
+static int osfs_unlink_entry(struct inode *dir, struct dentry *dentry)
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = osfs_remove_dir_entry(dir, &dentry->d_name);
+    if (ret)
+        return ret;
+
+    inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
+    inode_set_ctime_to_ts(inode, inode_get_ctime(dir));
+    drop_nlink(inode);
+    osfs_sync_nlink(inode);
+    return 0;
+}
+
+/**
+ * Function: osfs_unlink
+ * Description: Removes a name of a file from a directory. The inode and its
+ *              blocks are freed by osfs_evict_inode once the last user lets go.
+ * Inputs:
+ *   - dir: The inode of the parent directory.
+ *   - dentry: The dentry of the name to remove.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from osfs_remove_dir_entry on failure.
+ */
+static int osfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    int ret;
+
+    osfs_meta_begin(sb_info);
+    ret = osfs_unlink_entry(dir, dentry);
+    osfs_meta_end(sb_info);
+    if (!ret) {
+        mark_inode_dirty(dir);
+        mark_inode_dirty(d_inode(dentry));
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_rmdir
+ * Description: Removes an empty directory.
+ * Inputs:
+ *   - dir: The inode of the parent directory.
+ *   - dentry: The dentry of the directory to remove.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOTEMPTY if the directory still has entries.
+ *   - Another negative error code on failure.
+ */
+static int osfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = osfs_dir_check_empty(inode);
+    if (ret)
+        return ret;
+    osfs_meta_begin(sb_info);
+    ret = osfs_unlink_entry(dir, dentry);
+    if (!ret) {
+        // 再少掉自己的 "."，父目錄也少了被 ".." 指到的那一個
+        drop_nlink(inode);
+        drop_nlink(dir);
+        osfs_sync_nlink(inode);
+        osfs_sync_nlink(dir);
+    }
+    osfs_meta_end(sb_info);
+    if (!ret) {
+        mark_inode_dirty(dir);
+        mark_inode_dirty(inode);
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_rename
+ * Description: Renames a directory entry, replacing or exchanging with the
+ *              target as requested. Existing entries are changed in place, so
+ *              once the hash indexes are built only adding a brand-new name
+ *              can fail, and it does so before anything has changed.
+ * Inputs:
+ *   - idmap: The mount namespace ID map.
+ *   - old_dir: The inode of the source directory.
+ *   - old_dentry: The dentry of the source.
+ *   - new_dir: The inode of the target directory.
+ *   - new_dentry: The dentry of the target.
+ *   - flags: 0, RENAME_NOREPLACE or RENAME_EXCHANGE.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL for other flags.
+ *   - -ENOTEMPTY if the target is a directory with entries.
+ *   - Another negative error code on failure.
+ */
+static int osfs_rename(struct mnt_idmap *idmap, struct inode *old_dir, struct dentry *old_dentry,
+                       struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+{
+    struct osfs_sb_info *sb_info = old_dir->i_sb->s_fs_info;
+    struct inode *inode = d_inode(old_dentry);
+    struct inode *target = d_inode(new_dentry);
+    bool is_dir = S_ISDIR(inode->i_mode);
+    struct osfs_dir_index *index;
+    int ret;
+
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+        return -EINVAL;
+
+    // 先把兩邊的 index 建好，之後改目錄項目就不會做到一半因為記憶體不足而失敗
+    index = osfs_dir_get_index(sb_info, old_dir);
+    if (IS_ERR(index))
+        return PTR_ERR(index);
+    index = osfs_dir_get_index(sb_info, new_dir);
+    if (IS_ERR(index))
+        return PTR_ERR(index);
+
+    osfs_meta_begin(sb_info);
+    if (flags & RENAME_EXCHANGE) {
+        ret = osfs_retarget_dir_entry(old_dir, &old_dentry->d_name, target);
+        if (!ret)
+            ret = osfs_retarget_dir_entry(new_dir, &new_dentry->d_name, inode);
+        if (ret)
+            goto out;
+
+        // 目錄和非目錄跨目錄交換時，".." 的連結跟著目錄搬家
+        if (old_dir != new_dir && is_dir != S_ISDIR(target->i_mode)) {
+            if (is_dir) {
+                drop_nlink(old_dir);
+                inc_nlink(new_dir);
+            } else {
+                drop_nlink(new_dir);
+                inc_nlink(old_dir);
+            }
+        }
+    } else {
+        // RENAME_NOREPLACE 時 VFS 已經確認目標不存在
+        if (target) {
+            if (is_dir) {
+                ret = osfs_dir_check_empty(target);
+                if (ret)
+                    goto out;
+            }
+            ret = osfs_retarget_dir_entry(new_dir, &new_dentry->d_name, inode);
+        } else {
+            ret = osfs_add_dir_entry(new_dir, inode->i_ino, inode->i_mode,
+                                     new_dentry->d_name.name, new_dentry->d_name.len);
+        }
+        if (ret)
+            goto out;
+        ret = osfs_remove_dir_entry(old_dir, &old_dentry->d_name);
+        if (ret)
+            goto out;
+
+        if (target) {
+            drop_nlink(target);
+            if (is_dir) {
+                drop_nlink(target);
+                drop_nlink(old_dir);
+            }
+            inode_set_ctime_to_ts(target, current_time(target));
+            osfs_sync_nlink(target);
+        } else if (is_dir) {
+            drop_nlink(old_dir);
+            inc_nlink(new_dir);
+        }
+    }
+
+    osfs_sync_nlink(old_dir);
+    osfs_sync_nlink(new_dir);
+    simple_rename_timestamp(old_dir, old_dentry, new_dir, new_dentry);
+out:
+    osfs_meta_end(sb_info);
+    if (ret)
+        return ret;
+    if (target)
+        mark_inode_dirty(target);
+    mark_inode_dirty(old_dir);
+    mark_inode_dirty(new_dir);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
 const struct inode_operations osfs_dir_inode_operations = {
     .lookup = osfs_lookup,
     .create = osfs_create,
-    // Add other operations as needed
+    .mkdir = osfs_mkdir,
+    .unlink = osfs_unlink,
+    .rmdir = osfs_rmdir,
+    .rename = osfs_rename,
 };
 
 const struct file_operations osfs_dir_operations = {
     .iterate_shared = osfs_iterate,
     .llseek = generic_file_llseek,
+    .fsync = osfs_fsync,
     // Add other operations as needed
 };
@@ -0,0 +1,278 @@
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include "osfs.h"
+
+/*
+ * Each directory gets an in-memory hash index that maps the name hash stored
+ * in a directory entry to the entry's position in the directory. The index is
+ * a cache: it is built from the directory blocks on first use and can always
+ * be rebuilt from them. Buckets are doubled once the average chain length
+ * exceeds OSFS_DIR_INDEX_LOAD, so lookups stay O(1) on average.
+ *
+ * The index also tracks the largest gap in each directory block and, for each
+ * of a few size classes, which blocks have a gap at least that large, so
+ * adding an entry finds a block with space for it without rescanning the
+ * directory, and the space freed by removing short names is reused by short
+ * names.
+ */
+
+#define OSFS_DIR_INDEX_MIN_BITS 4
+#define OSFS_DIR_INDEX_LOAD 2
+
+// Gap size of each size class, up to a maximum-length entry
+static const uint32_t osfs_dir_room_class[OSFS_DIR_ROOM_CLASSES] = {
+    OSFS_DIR_REC_LEN(1), OSFS_DIR_REC_LEN(5), OSFS_DIR_REC_LEN(9), OSFS_DIR_REC_LEN(17),
+    OSFS_DIR_REC_LEN(33), OSFS_DIR_REC_LEN(49), OSFS_DIR_REC_LEN(81), OSFS_DIR_REC_LEN(113),
+    OSFS_DIR_REC_LEN(177), OSFS_DIR_REC_LEN(MAX_FILENAME_LEN),
+};
+
+static inline struct hlist_head *osfs_dir_index_bucket(struct osfs_dir_index *index, uint32_t hash)
+{
+    return &index->buckets[hash_32(hash, index->bits)];
+}
+
+/**
+ * Function: osfs_dir_index_create
+ * Description: Allocates an empty directory hash index.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - A pointer to the new index.
+ *   - NULL if memory allocation fails.
+ */
+struct osfs_dir_index *osfs_dir_index_create(void)
+{
+    struct osfs_dir_index *index;
+
+    index = kzalloc(sizeof(*index), GFP_KERNEL);
+    if (!index)
+        return NULL;
+
+    index->bits = OSFS_DIR_INDEX_MIN_BITS;
+    index->buckets = kvcalloc(1U << index->bits, sizeof(struct hlist_head), GFP_KERNEL);
+    if (!index->buckets) {
+        kfree(index);
+        return NULL;
+    }
+    return index;
+}
+
+/**
+ * Function: osfs_dir_index_grow
+ * Description: Doubles the number of buckets of an index and rehashes its entries.
+ *              Failing to grow is harmless: the index just gets longer chains.
+ * Inputs:
+ *   - index: The directory hash index.
+ * Returns:
+ *   - None.
+ */
+static void osfs_dir_index_grow(struct osfs_dir_index *index)
+{
+    unsigned int old_bits = index->bits;
+    struct hlist_head *old_buckets = index->buckets;
+    struct hlist_head *new_buckets;
+    struct osfs_dir_index_entry *entry;
+    struct hlist_node *tmp;
+    uint32_t i;
+
+    new_buckets = kvcalloc(1U << (old_bits + 1), sizeof(struct hlist_head), GFP_KERNEL);
+    if (!new_buckets)
+        return;
+
+    index->buckets = new_buckets;
+    index->bits = old_bits + 1;
+    for (i = 0; i < (1U << old_bits); i++) {
+        hlist_for_each_entry_safe(entry, tmp, &old_buckets[i], node) {
+            hlist_del(&entry->node);
+            hlist_add_head(&entry->node, osfs_dir_index_bucket(index, entry->hash));
+        }
+    }
+    kvfree(old_buckets);
+}
+
+/**
+ * Function: osfs_dir_index_add
+ * Description: Records that the entry at a position of the directory has a name hash.
+ * Inputs:
+ *   - index: The directory hash index.
+ *   - hash: The name hash of the entry.
+ *   - pos: The position of the entry in the directory.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ */
+int osfs_dir_index_add(struct osfs_dir_index *index, uint32_t hash, uint32_t pos)
+{
+    struct osfs_dir_index_entry *entry;
+
+    entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry)
+        return -ENOMEM;
+
+    entry->hash = hash;
+    entry->pos = pos;
+    hlist_add_head(&entry->node, osfs_dir_index_bucket(index, hash));
+
+    if (++index->count > (OSFS_DIR_INDEX_LOAD << index->bits))
+        osfs_dir_index_grow(index);
+    return 0;
+}
+
+/**
+ * Function: osfs_dir_index_find
+ * Description: Finds the index entry recorded for a position of the directory.
+ * Inputs:
+ *   - index: The directory hash index.
+ *   - hash: The name hash of the entry.
+ *   - pos: The position of the entry in the directory.
+ * Returns:
+ *   - The index entry, or NULL if none is recorded.
+ */
+struct osfs_dir_index_entry *osfs_dir_index_find(struct osfs_dir_index *index, uint32_t hash, uint32_t pos)
+{
+    struct osfs_dir_index_entry *entry;
+
+    osfs_dir_index_for_each_possible(index, entry, hash) {
+        if (entry->pos == pos)
+            return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Function: osfs_dir_index_del
+ * Description: Forgets the entry at a position of the directory.
+ * Inputs:
+ *   - index: The directory hash index.
+ *   - hash: The name hash of the entry.
+ *   - pos: The position of the entry in the directory.
+ * Returns:
+ *   - None.
+ */
+void osfs_dir_index_del(struct osfs_dir_index *index, uint32_t hash, uint32_t pos)
+{
+    struct osfs_dir_index_entry *entry = osfs_dir_index_find(index, hash, pos);
+
+    if (!entry)
+        return;
+    hlist_del(&entry->node);
+    kfree(entry);
+    index->count--;
+}
+
+/**
+ * Function: osfs_dir_index_set_free
+ * Description: Records the largest gap in a directory block and the size
+ *              classes it now belongs to. Blocks past the last tracked one
+ *              extend the directory.
+ * Inputs:
+ *   - index: The directory hash index.
+ *   - block: The logical block number within the directory.
+ *   - free: The size of the largest gap in the block, in bytes.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the per-block arrays cannot grow.
+ */
+int osfs_dir_index_set_free(struct osfs_dir_index *index, uint32_t block, uint32_t free)
+{
+    size_t old_longs, new_longs;
+    uint32_t *block_free;
+    unsigned long *roomy;
+    uint32_t cap;
+    int i;
+
+    if (block >= index->blocks_cap) {
+        cap = max3(16U, index->blocks_cap * 2, block + 1);
+        block_free = kvrealloc(index->block_free, index->blocks_cap * sizeof(uint32_t),
+                               cap * sizeof(uint32_t), GFP_KERNEL);
+        if (!block_free)
+            return -ENOMEM;
+        index->block_free = block_free;
+
+        // 失敗時已經長大的 bitmap 照舊可用，下次再從 blocks_cap 長一次
+        old_longs = BITS_TO_LONGS(index->blocks_cap);
+        new_longs = BITS_TO_LONGS(cap);
+        for (i = 0; i < OSFS_DIR_ROOM_CLASSES; i++) {
+            roomy = kvrealloc(index->roomy[i], old_longs * sizeof(unsigned long),
+                              new_longs * sizeof(unsigned long), GFP_KERNEL);
+            if (!roomy)
+                return -ENOMEM;
+            memset(roomy + old_longs, 0, (new_longs - old_longs) * sizeof(unsigned long));
+            index->roomy[i] = roomy;
+        }
+        index->blocks_cap = cap;
+    }
+    if (block >= index->nr_blocks)
+        index->nr_blocks = block + 1;
+
+    index->block_free[block] = free;
+    for (i = 0; i < OSFS_DIR_ROOM_CLASSES; i++) {
+        if (free >= osfs_dir_room_class[i])
+            set_bit(block, index->roomy[i]);
+        else
+            clear_bit(block, index->roomy[i]);
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_dir_index_find_room
+ * Description: Picks a directory block with a gap large enough for a new entry.
+ *              The block used by the previous insertion is tried first, then
+ *              any block in the smallest size class the entry fits in.
+ * Inputs:
+ *   - index: The directory hash index.
+ *   - rec_len: The record length of the new entry.
+ *   - block: Where to store the chosen block.
+ * Returns:
+ *   - true if a block was found.
+ *   - false if the directory needs a new block.
+ */
+bool osfs_dir_index_find_room(struct osfs_dir_index *index, uint32_t rec_len, uint32_t *block)
+{
+    unsigned long roomy_block;
+    int i;
+
+    if (index->last_block < index->nr_blocks && index->block_free[index->last_block] >= rec_len) {
+        *block = index->last_block;
+        return true;
+    }
+
+    for (i = 0; i < OSFS_DIR_ROOM_CLASSES - 1 && osfs_dir_room_class[i] < rec_len; i++)
+        ;
+    roomy_block = find_first_bit(index->roomy[i], index->nr_blocks);
+    if (roomy_block >= index->nr_blocks)
+        return false;
+    *block = index->last_block = roomy_block;
+    return true;
+}
+
+/**
+ * Function: osfs_dir_index_destroy
+ * Description: Frees a directory hash index and all of its entries.
+ * Inputs:
+ *   - index: The directory hash index, may be NULL.
+ * Returns:
+ *   - None.
+ */
+void osfs_dir_index_destroy(struct osfs_dir_index *index)
+{
+    struct osfs_dir_index_entry *entry;
+    struct hlist_node *tmp;
+    uint32_t i;
+
+    if (!index)
+        return;
+
+    for (i = 0; i < (1U << index->bits); i++) {
+        hlist_for_each_entry_safe(entry, tmp, &index->buckets[i], node)
+            kfree(entry);
+    }
+    kvfree(index->buckets);
+    kvfree(index->block_free);
+    for (i = 0; i < OSFS_DIR_ROOM_CLASSES; i++)
+        kvfree(index->roomy[i]);
+    kfree(index);
+}
@@ -0,0 +1,722 @@
+#include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include "osfs.h"
+
+/*
+ * A file's block map is a sorted list of extents, each mapping a run of
+ * logical blocks onto a run of physical blocks. The first OSFS_INLINE_EXTENTS
+ * extents live in the osfs_inode itself. When a file needs more, all of its
+ * extents move into an rb-tree keyed by logical start (the overflow tree), and
+ * the inline array is no longer used until the tree becomes empty again.
+ * Tree lookups first try the extent of the previous lookup and its successor,
+ * so sequential access costs O(1) and random access O(log n) per block.
+ *
+ * The map is protected by i_extent_sem: lookups need it held for reading,
+ * changes need it held for writing. Lookups still move the cursor, which is
+ * only a hint, so it is read and written with READ_ONCE/WRITE_ONCE.
+ *
+ * Extents flagged OSFS_EXTENT_UNWRITTEN own their blocks but have never been
+ * written; they read as zeros. Only extents with the same flags are merged.
+ */
+
+/**
+ * Struct: osfs_extent_node
+ * Description: An extent stored in the overflow tree of an inode.
+ */
+struct osfs_extent_node {
+    struct rb_node node;
+    struct osfs_extent ext;
+};
+
+static inline bool osfs_extent_in_tree(struct osfs_inode *osfs_inode)
+{
+    return !RB_EMPTY_ROOT(&osfs_inode->i_extent_tree);
+}
+
+// Whether block (lblk, pblk) with flags directly follows the extent
+static inline bool osfs_extent_follows(const struct osfs_extent *ext, uint32_t lblk,
+                                       uint32_t pblk, uint32_t flags)
+{
+    return (uint64_t)ext->e_lblk + ext->e_len == lblk &&
+           (uint64_t)ext->e_pblk + ext->e_len == pblk && ext->e_flags == flags;
+}
+
+// Whether block (lblk, pblk) with flags directly precedes the extent
+static inline bool osfs_extent_precedes(const struct osfs_extent *ext, uint32_t lblk,
+                                        uint32_t pblk, uint32_t flags)
+{
+    return (uint64_t)lblk + 1 == ext->e_lblk && (uint64_t)pblk + 1 == ext->e_pblk &&
+           ext->e_flags == flags;
+}
+
+/**
+ * Function: osfs_extent_tree_floor
+ * Description: Finds the last extent of the overflow tree starting at or before a logical block.
+ * Inputs:
+ *   - root: The overflow tree.
+ *   - lblk: The logical block number.
+ * Returns:
+ *   - The extent node, or NULL if every extent starts after lblk.
+ */
+static struct osfs_extent_node *osfs_extent_tree_floor(struct rb_root *root, uint32_t lblk)
+{
+    struct rb_node *node = root->rb_node;
+    struct osfs_extent_node *floor = NULL;
+
+    while (node) {
+        struct osfs_extent_node *entry = rb_entry(node, struct osfs_extent_node, node);
+
+        if (entry->ext.e_lblk <= lblk) {
+            floor = entry;
+            node = node->rb_right;
+        } else {
+            node = node->rb_left;
+        }
+    }
+    return floor;
+}
+
+/**
+ * Function: osfs_extent_tree_find
+ * Description: Same as osfs_extent_tree_floor, but first tries the extent hit
+ *              by the previous lookup and its successor, so sequential access
+ *              does not walk the tree.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The logical block number.
+ * Returns:
+ *   - The extent node, or NULL if every extent starts after lblk.
+ */
+static struct osfs_extent_node *osfs_extent_tree_find(struct osfs_inode *osfs_inode, uint32_t lblk)
+{
+    struct osfs_extent_node *cursor = READ_ONCE(osfs_inode->i_extent_cursor);
+    struct osfs_extent_node *next;
+    struct rb_node *node;
+
+    if (cursor && cursor->ext.e_lblk <= lblk) {
+        node = rb_next(&cursor->node);
+        if (!node)
+            return cursor;
+        next = rb_entry(node, struct osfs_extent_node, node);
+        if (lblk < next->ext.e_lblk)
+            return cursor;
+
+        node = rb_next(&next->node);
+        if (!node || lblk < rb_entry(node, struct osfs_extent_node, node)->ext.e_lblk)
+            return next;
+    }
+    return osfs_extent_tree_floor(&osfs_inode->i_extent_tree, lblk);
+}
+
+/**
+ * Function: osfs_extent_tree_add
+ * Description: Links a new extent into the overflow tree.
+ * Inputs:
+ *   - root: The overflow tree.
+ *   - ext: The extent to add. It must not overlap any extent in the tree.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the tree node cannot be allocated.
+ */
+static int osfs_extent_tree_add(struct rb_root *root, const struct osfs_extent *ext)
+{
+    struct rb_node **link = &root->rb_node;
+    struct rb_node *parent = NULL;
+    struct osfs_extent_node *new_node;
+
+    new_node = kmalloc(sizeof(*new_node), GFP_KERNEL);
+    if (!new_node)
+        return -ENOMEM;
+    new_node->ext = *ext;
+
+    while (*link) {
+        struct osfs_extent_node *entry = rb_entry(*link, struct osfs_extent_node, node);
+
+        parent = *link;
+        if (ext->e_lblk < entry->ext.e_lblk)
+            link = &(*link)->rb_left;
+        else
+            link = &(*link)->rb_right;
+    }
+    rb_link_node(&new_node->node, parent, link);
+    rb_insert_color(&new_node->node, root);
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_move_to_tree
+ * Description: Moves the inline extents of an inode into its overflow tree.
+ * Inputs:
+ *   - osfs_inode: The inode whose inline extents are full.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if a tree node cannot be allocated; the inline extents are left intact.
+ */
+static int osfs_extent_move_to_tree(struct osfs_inode *osfs_inode)
+{
+    struct rb_root tree = RB_ROOT;
+    int i, ret;
+
+    for (i = 0; i < osfs_inode->i_nr_extents; i++) {
+        ret = osfs_extent_tree_add(&tree, &osfs_inode->i_extents[i]);
+        if (ret) {
+            struct osfs_extent_node *entry, *next;
+
+            rbtree_postorder_for_each_entry_safe(entry, next, &tree, node)
+                kfree(entry);
+            return ret;
+        }
+    }
+    osfs_inode->i_extent_tree = tree;
+    memset(osfs_inode->i_extents, 0, sizeof(osfs_inode->i_extents));
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_lookup
+ * Description: Maps a logical block of a file to its physical block.
+ *              Called with i_extent_sem held.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The logical block number.
+ *   - pblk: Where to store the physical block number when mapped.
+ *   - flags: Where to store the extent flags when mapped, may be NULL.
+ * Returns:
+ *   - The number of contiguous mapped blocks with the same flags starting at
+ *     lblk (at least 1).
+ *   - 0 if lblk is a hole.
+ */
+uint32_t osfs_extent_lookup(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t *pblk,
+                            uint32_t *flags)
+{
+    const struct osfs_extent *ext = NULL;
+    int i;
+
+    lockdep_assert_held(&osfs_inode->i_extent_sem);
+
+    if (osfs_extent_in_tree(osfs_inode)) {
+        struct osfs_extent_node *floor = osfs_extent_tree_find(osfs_inode, lblk);
+
+        if (floor) {
+            WRITE_ONCE(osfs_inode->i_extent_cursor, floor);
+            ext = &floor->ext;
+        }
+    } else {
+        for (i = 0; i < osfs_inode->i_nr_extents && osfs_inode->i_extents[i].e_lblk <= lblk; i++)
+            ext = &osfs_inode->i_extents[i];
+    }
+
+    if (!ext || lblk >= (uint64_t)ext->e_lblk + ext->e_len)
+        return 0;
+    *pblk = ext->e_pblk + (lblk - ext->e_lblk);
+    if (flags)
+        *flags = ext->e_flags;
+    return ext->e_len - (lblk - ext->e_lblk);
+}
+
+/**
+ * Function: osfs_extent_insert_inline
+ * Description: Maps one block in the inline extent array, extending a
+ *              neighbouring extent when the block is contiguous with it.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The logical block number, currently a hole.
+ *   - pblk: The physical block number.
+ *   - flags: The extent flags of the block.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if a new extent is needed but the inline array is full.
+ */
+static int osfs_extent_insert_inline(struct osfs_inode *osfs_inode, uint32_t lblk,
+                                     uint32_t pblk, uint32_t flags)
+{
+    struct osfs_extent *exts = osfs_inode->i_extents;
+    int nr = osfs_inode->i_nr_extents;
+    int i;
+
+    // i 是第一個起點在 lblk 之後的 extent
+    for (i = 0; i < nr && exts[i].e_lblk < lblk; i++)
+        ;
+
+    if (i > 0 && osfs_extent_follows(&exts[i - 1], lblk, pblk, flags)) {
+        exts[i - 1].e_len++;
+        // 剛好接上後一個 extent，兩個合併成一個
+        if (i < nr && osfs_extent_follows(&exts[i - 1], exts[i].e_lblk, exts[i].e_pblk,
+                                          exts[i].e_flags)) {
+            exts[i - 1].e_len += exts[i].e_len;
+            memmove(&exts[i], &exts[i + 1], (nr - i - 1) * sizeof(*exts));
+            memset(&exts[nr - 1], 0, sizeof(*exts));
+            osfs_inode->i_nr_extents--;
+        }
+        return 0;
+    }
+    if (i < nr && osfs_extent_precedes(&exts[i], lblk, pblk, flags)) {
+        exts[i].e_lblk--;
+        exts[i].e_pblk--;
+        exts[i].e_len++;
+        return 0;
+    }
+
+    if (nr == OSFS_INLINE_EXTENTS)
+        return -ENOSPC;
+    memmove(&exts[i + 1], &exts[i], (nr - i) * sizeof(*exts));
+    exts[i].e_lblk = lblk;
+    exts[i].e_pblk = pblk;
+    exts[i].e_len = 1;
+    exts[i].e_flags = flags;
+    osfs_inode->i_nr_extents++;
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_insert_tree
+ * Description: Maps one block in the overflow tree, extending a neighbouring
+ *              extent when the block is contiguous with it.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The logical block number, currently a hole.
+ *   - pblk: The physical block number.
+ *   - flags: The extent flags of the block.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if a tree node cannot be allocated.
+ */
+static int osfs_extent_insert_tree(struct osfs_inode *osfs_inode, uint32_t lblk,
+                                   uint32_t pblk, uint32_t flags)
+{
+    struct rb_root *root = &osfs_inode->i_extent_tree;
+    struct osfs_extent_node *prev, *next = NULL;
+    struct rb_node *next_node;
+    struct osfs_extent ext;
+    int ret;
+
+    prev = osfs_extent_tree_find(osfs_inode, lblk);
+    next_node = prev ? rb_next(&prev->node) : rb_first(root);
+    if (next_node)
+        next = rb_entry(next_node, struct osfs_extent_node, node);
+
+    if (prev && osfs_extent_follows(&prev->ext, lblk, pblk, flags)) {
+        prev->ext.e_len++;
+        if (next && osfs_extent_follows(&prev->ext, next->ext.e_lblk, next->ext.e_pblk,
+                                        next->ext.e_flags)) {
+            prev->ext.e_len += next->ext.e_len;
+            if (READ_ONCE(osfs_inode->i_extent_cursor) == next)
+                WRITE_ONCE(osfs_inode->i_extent_cursor, prev);
+            rb_erase(&next->node, root);
+            kfree(next);
+            osfs_inode->i_nr_extents--;
+        }
+        return 0;
+    }
+    // 往前延伸不會改變 next 在樹中的相對順序
+    if (next && osfs_extent_precedes(&next->ext, lblk, pblk, flags)) {
+        next->ext.e_lblk--;
+        next->ext.e_pblk--;
+        next->ext.e_len++;
+        return 0;
+    }
+
+    ext.e_lblk = lblk;
+    ext.e_pblk = pblk;
+    ext.e_len = 1;
+    ext.e_flags = flags;
+    ret = osfs_extent_tree_add(root, &ext);
+    if (ret)
+        return ret;
+    osfs_inode->i_nr_extents++;
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_insert
+ * Description: Maps a logical block of a file to a physical block.
+ *              Called with i_extent_sem held for writing.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The logical block number, currently a hole.
+ *   - pblk: The physical block number.
+ *   - flags: The extent flags of the block.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the overflow tree cannot grow.
+ */
+int osfs_extent_insert(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t pblk, uint32_t flags)
+{
+    int ret;
+
+    lockdep_assert_held_write(&osfs_inode->i_extent_sem);
+
+    if (!osfs_extent_in_tree(osfs_inode)) {
+        ret = osfs_extent_insert_inline(osfs_inode, lblk, pblk, flags);
+        if (ret != -ENOSPC)
+            return ret;
+        // inline 的 extent 用完了，全部搬到 overflow tree
+        ret = osfs_extent_move_to_tree(osfs_inode);
+        if (ret)
+            return ret;
+    }
+    return osfs_extent_insert_tree(osfs_inode, lblk, pblk, flags);
+}
+
+/*
+ * Range operations. They work on both representations through the helpers
+ * below, which hand out pointers to extents in the inline array or in tree
+ * nodes. Any change to the map may move inline extents, so callers look the
+ * extent up again after each change instead of holding on to pointers.
+ */
+
+// The extent containing lblk, or else the first extent after it
+static struct osfs_extent *osfs_extent_seek(struct osfs_inode *osfs_inode, uint32_t lblk)
+{
+    struct osfs_extent_node *floor;
+    struct rb_node *node;
+    int i;
+
+    if (!osfs_extent_in_tree(osfs_inode)) {
+        for (i = 0; i < osfs_inode->i_nr_extents; i++) {
+            if (lblk < (uint64_t)osfs_inode->i_extents[i].e_lblk + osfs_inode->i_extents[i].e_len)
+                return &osfs_inode->i_extents[i];
+        }
+        return NULL;
+    }
+
+    floor = osfs_extent_tree_find(osfs_inode, lblk);
+    if (floor && lblk < (uint64_t)floor->ext.e_lblk + floor->ext.e_len)
+        return &floor->ext;
+    node = floor ? rb_next(&floor->node) : rb_first(&osfs_inode->i_extent_tree);
+    return node ? &rb_entry(node, struct osfs_extent_node, node)->ext : NULL;
+}
+
+static struct osfs_extent *osfs_extent_prev(struct osfs_inode *osfs_inode, struct osfs_extent *ext)
+{
+    struct rb_node *node;
+
+    if (!osfs_extent_in_tree(osfs_inode))
+        return ext > osfs_inode->i_extents ? ext - 1 : NULL;
+    node = rb_prev(&container_of(ext, struct osfs_extent_node, ext)->node);
+    return node ? &rb_entry(node, struct osfs_extent_node, node)->ext : NULL;
+}
+
+static struct osfs_extent *osfs_extent_next(struct osfs_inode *osfs_inode, struct osfs_extent *ext)
+{
+    struct rb_node *node;
+
+    if (!osfs_extent_in_tree(osfs_inode))
+        return ext + 1 < osfs_inode->i_extents + osfs_inode->i_nr_extents ? ext + 1 : NULL;
+    node = rb_next(&container_of(ext, struct osfs_extent_node, ext)->node);
+    return node ? &rb_entry(node, struct osfs_extent_node, node)->ext : NULL;
+}
+
+// Removes an extent from the map without touching its blocks
+static void osfs_extent_erase(struct osfs_inode *osfs_inode, struct osfs_extent *ext)
+{
+    struct osfs_extent_node *node;
+    int i, nr = osfs_inode->i_nr_extents;
+
+    if (osfs_extent_in_tree(osfs_inode)) {
+        node = container_of(ext, struct osfs_extent_node, ext);
+        if (READ_ONCE(osfs_inode->i_extent_cursor) == node)
+            WRITE_ONCE(osfs_inode->i_extent_cursor, NULL);
+        rb_erase(&node->node, &osfs_inode->i_extent_tree);
+        kfree(node);
+    } else {
+        i = ext - osfs_inode->i_extents;
+        memmove(&osfs_inode->i_extents[i], &osfs_inode->i_extents[i + 1],
+                (nr - i - 1) * sizeof(*ext));
+        memset(&osfs_inode->i_extents[nr - 1], 0, sizeof(*ext));
+    }
+    osfs_inode->i_nr_extents--;
+}
+
+// Adds an extent that does not overlap any other
+static int osfs_extent_add(struct osfs_inode *osfs_inode, const struct osfs_extent *ext)
+{
+    struct osfs_extent *exts = osfs_inode->i_extents;
+    int i, nr = osfs_inode->i_nr_extents;
+    int ret;
+
+    if (!osfs_extent_in_tree(osfs_inode)) {
+        if (nr < OSFS_INLINE_EXTENTS) {
+            for (i = 0; i < nr && exts[i].e_lblk < ext->e_lblk; i++)
+                ;
+            memmove(&exts[i + 1], &exts[i], (nr - i) * sizeof(*exts));
+            exts[i] = *ext;
+            osfs_inode->i_nr_extents++;
+            return 0;
+        }
+        ret = osfs_extent_move_to_tree(osfs_inode);
+        if (ret)
+            return ret;
+    }
+
+    ret = osfs_extent_tree_add(&osfs_inode->i_extent_tree, ext);
+    if (ret)
+        return ret;
+    osfs_inode->i_nr_extents++;
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_find
+ * Description: Finds the extent containing a logical block, or else the first
+ *              extent after it. Called with i_extent_sem held.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The logical block number.
+ *   - ext: Where to copy the extent.
+ * Returns:
+ *   - true if an extent was found.
+ *   - false if no extent ends after lblk.
+ */
+bool osfs_extent_find(struct osfs_inode *osfs_inode, uint32_t lblk, struct osfs_extent *ext)
+{
+    struct osfs_extent *found;
+
+    lockdep_assert_held(&osfs_inode->i_extent_sem);
+
+    found = osfs_extent_seek(osfs_inode, lblk);
+    if (!found)
+        return false;
+    *ext = *found;
+    return true;
+}
+
+/**
+ * Function: osfs_extent_restore
+ * Description: Adds a whole extent read back from an image while mounting,
+ *              before the inode can be used. Extents must be added in
+ *              logical block order and must not overlap.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - ext: The extent to add.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if a tree node cannot be allocated.
+ */
+int osfs_extent_restore(struct osfs_inode *osfs_inode, const struct osfs_extent *ext)
+{
+    return osfs_extent_add(osfs_inode, ext);
+}
+
+/**
+ * Function: osfs_extent_split
+ * Description: Splits the extent containing lblk, if any, so that lblk starts an extent.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The logical block number.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the second half cannot be stored; the map is unchanged.
+ */
+static int osfs_extent_split(struct osfs_inode *osfs_inode, uint32_t lblk)
+{
+    struct osfs_extent *ext = osfs_extent_seek(osfs_inode, lblk);
+    struct osfs_extent tail;
+    int ret;
+
+    if (!ext || ext->e_lblk >= lblk)
+        return 0;
+
+    tail.e_lblk = lblk;
+    tail.e_pblk = ext->e_pblk + (lblk - ext->e_lblk);
+    tail.e_len = ext->e_len - (lblk - ext->e_lblk);
+    tail.e_flags = ext->e_flags;
+    ext->e_len -= tail.e_len;
+
+    ret = osfs_extent_add(osfs_inode, &tail);
+    // 失敗時 map 沒有變動，ext 仍然有效
+    if (ret)
+        ext->e_len += tail.e_len;
+    return ret;
+}
+
+/**
+ * Function: osfs_extent_merge
+ * Description: Merges an extent with its neighbours where they are contiguous
+ *              and have the same flags.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - ext: The extent.
+ * Returns:
+ *   - The extent that now covers ext's blocks.
+ */
+static struct osfs_extent *osfs_extent_merge(struct osfs_inode *osfs_inode, struct osfs_extent *ext)
+{
+    struct osfs_extent *prev = osfs_extent_prev(osfs_inode, ext);
+    struct osfs_extent *next;
+
+    if (prev && osfs_extent_follows(prev, ext->e_lblk, ext->e_pblk, ext->e_flags)) {
+        prev->e_len += ext->e_len;
+        osfs_extent_erase(osfs_inode, ext);
+        ext = prev;
+    }
+    next = osfs_extent_next(osfs_inode, ext);
+    if (next && osfs_extent_follows(ext, next->e_lblk, next->e_pblk, next->e_flags)) {
+        ext->e_len += next->e_len;
+        osfs_extent_erase(osfs_inode, next);
+    }
+    return ext;
+}
+
+/**
+ * Function: osfs_extent_remove
+ * Description: Unmaps a range of logical blocks of a file and frees the data
+ *              blocks behind it. Called with i_extent_sem held for writing.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The first logical block to unmap.
+ *   - len: The number of logical blocks to unmap; may run past the last block.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if an extent straddling the range cannot be split. Nothing is
+ *     unmapped in that case.
+ */
+int osfs_extent_remove(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                       uint32_t lblk, uint64_t len)
+{
+    uint64_t end = (uint64_t)lblk + len;
+    struct osfs_extent *ext;
+    uint32_t pblk, nr, i;
+    int ret;
+
+    lockdep_assert_held_write(&osfs_inode->i_extent_sem);
+
+    ret = osfs_extent_split(osfs_inode, lblk);
+    if (!ret && end <= U32_MAX)
+        ret = osfs_extent_split(osfs_inode, end);
+    if (ret)
+        return ret;
+
+    // 切完之後，範圍內的 extent 都整個落在範圍裡
+    while ((ext = osfs_extent_seek(osfs_inode, lblk)) && ext->e_lblk < end) {
+        pblk = ext->e_pblk;
+        nr = ext->e_len;
+        osfs_extent_erase(osfs_inode, ext);
+        for (i = 0; i < nr; i++)
+            osfs_free_data_block(sb_info, pblk + i);
+        osfs_inode->i_blocks -= nr;
+    }
+    osfs_image_dirty_inode(sb_info, osfs_inode->i_ino);
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_set_flags
+ * Description: Replaces the flags of the mapped blocks in a range of logical
+ *              blocks, for example to clear OSFS_EXTENT_UNWRITTEN once data
+ *              has been stored in them. Holes in the range are left alone.
+ *              Called with i_extent_sem held for writing.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The first logical block of the range.
+ *   - len: The number of logical blocks in the range.
+ *   - flags: The new extent flags.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if an extent straddling the range cannot be split.
+ */
+int osfs_extent_set_flags(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t len,
+                          uint32_t flags)
+{
+    uint64_t end = (uint64_t)lblk + len;
+    uint64_t cur;
+    struct osfs_extent *ext;
+    int ret;
+
+    lockdep_assert_held_write(&osfs_inode->i_extent_sem);
+
+    ret = osfs_extent_split(osfs_inode, lblk);
+    if (!ret && end <= U32_MAX)
+        ret = osfs_extent_split(osfs_inode, end);
+    if (ret)
+        return ret;
+
+    for (cur = lblk; cur < end; cur = (uint64_t)ext->e_lblk + ext->e_len) {
+        ext = osfs_extent_seek(osfs_inode, cur);
+        if (!ext || ext->e_lblk >= end)
+            break;
+        ext->e_flags = flags;
+        ext = osfs_extent_merge(osfs_inode, ext);
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_clear_new
+ * Description: Clears OSFS_EXTENT_NEW from every extent of a file, once the
+ *              data under them has been written back. Called with
+ *              i_extent_sem held for writing.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ * Returns:
+ *   - true if any extent had the flag.
+ */
+bool osfs_extent_clear_new(struct osfs_inode *osfs_inode)
+{
+    struct osfs_extent *ext;
+    bool found = false;
+    uint64_t cur;
+
+    lockdep_assert_held_write(&osfs_inode->i_extent_sem);
+
+    for (cur = 0; cur <= U32_MAX; cur = (uint64_t)ext->e_lblk + ext->e_len) {
+        ext = osfs_extent_seek(osfs_inode, cur);
+        if (!ext)
+            break;
+        if (ext->e_flags & OSFS_EXTENT_NEW) {
+            ext->e_flags &= ~OSFS_EXTENT_NEW;
+            ext = osfs_extent_merge(osfs_inode, ext);
+            found = true;
+        }
+    }
+    return found;
+}
+
+/**
+ * Function: osfs_extent_shift
+ * Description: Moves every extent starting at or after lblk down by shift
+ *              logical blocks. The shift blocks before lblk must be a hole.
+ *              Called with i_extent_sem held for writing.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The first logical block to move.
+ *   - shift: How many blocks to move them by, at most lblk.
+ * Returns:
+ *   - None.
+ */
+void osfs_extent_shift(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t shift)
+{
+    struct osfs_extent *ext, *first;
+
+    lockdep_assert_held_write(&osfs_inode->i_extent_sem);
+
+    first = osfs_extent_seek(osfs_inode, lblk);
+    // 前面是 hole，依序往前搬不會改變 extent 之間的順序，樹也不用重排
+    for (ext = first; ext; ext = osfs_extent_next(osfs_inode, ext))
+        ext->e_lblk -= shift;
+    if (first)
+        osfs_extent_merge(osfs_inode, first);
+}
+
+/**
+ * Function: osfs_extent_destroy
+ * Description: Frees the overflow tree of an inode and forgets all of its
+ *              extents. The data blocks themselves are not released.
+ * Inputs:
+ *   - osfs_inode: The inode of the file.
+ * Returns:
+ *   - None.
+ */
+void osfs_extent_destroy(struct osfs_inode *osfs_inode)
+{
+    struct osfs_extent_node *entry, *next;
+
+    rbtree_postorder_for_each_entry_safe(entry, next, &osfs_inode->i_extent_tree, node)
+        kfree(entry);
+    osfs_inode->i_extent_tree = RB_ROOT;
+    osfs_inode->i_extent_cursor = NULL;
+    memset(osfs_inode->i_extents, 0, sizeof(osfs_inode->i_extents));
+    osfs_inode->i_nr_extents = 0;
+}
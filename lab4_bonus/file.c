@@ -1,140 +1,1346 @@
 #include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/splice.h>
+#include <linux/falloc.h>
+#include <linux/buffer_head.h>
+#include <linux/mpage.h>
 #include "osfs.h"
 
 /**
- * Function: osfs_read
- * Description: Reads data from a file.
+ * Function: osfs_block_data
+ * Description: Returns the backing memory of a file's logical block.
  * Inputs:
- *   - filp: The file pointer representing the file to read from.
- *   - buf: The user-space buffer to copy the data into.
- *   - len: The number of bytes to read.
- *   - ppos: The file position pointer.
+ *   - inode: The VFS inode of the file.
+ *   - block_index: The logical block index within the file.
+ *   - flags: Where to store the extent flags of the block. If NULL, an
+ *            unwritten block is treated like a hole.
  * Returns:
- *   - The number of bytes read on success.
- *   - 0 if the end of the file is reached.
- *   - -EFAULT if copying data to user space fails.
+ *   - A pointer to the start of the data block.
+ *   - NULL if the logical block is not backed by a data block.
  */
-static ssize_t osfs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+static void *osfs_block_data(struct inode *inode, uint32_t block_index, uint32_t *flags)
 {
-    struct inode *inode = file_inode(filp);
-    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
-    void *data_block;
-    ssize_t bytes_read = 0;
-    
-    if (*ppos >= osfs_inode->i_size)
-        return 0;
+    uint32_t block_no, mapped, ext_flags = 0;
+
+    down_read(&osfs_inode->i_extent_sem);
+    mapped = osfs_extent_lookup(osfs_inode, block_index, &block_no, &ext_flags);
+    up_read(&osfs_inode->i_extent_sem);
+
+    // extent map 裡找不到就是 hole，還沒分配實體空間
+    if (!mapped)
+        return NULL;
+    if (flags)
+        *flags = ext_flags;
+    else if (ext_flags & OSFS_EXTENT_UNWRITTEN)
+        return NULL;
+    return osfs_block_addr(sb_info, block_no);
+}
+
+/**
+ * Function: osfs_block_dirty
+ * Description: Records that a data block of a file was modified, for the next
+ *              checkpoint. Called after the modification, so that a checkpoint
+ *              that clears the mark also sees the new contents.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - block_index: The logical block index within the file.
+ * Returns:
+ *   - None.
+ */
+static void osfs_block_dirty(struct inode *inode, uint32_t block_index)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t block_no, mapped;
+
+    // 沒有 image 就沒有 checkpoint，不用多查一次 extent
+    if (!sb_info->image)
+        return;
+
+    down_read(&osfs_inode->i_extent_sem);
+    mapped = osfs_extent_lookup(osfs_inode, block_index, &block_no, NULL);
+    up_read(&osfs_inode->i_extent_sem);
+    if (mapped)
+        osfs_image_dirty_block(sb_info, block_no);
+}
+
+/**
+ * Function: osfs_block_mark_written
+ * Description: Records that an unwritten block of a file now holds data.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - block_index: The logical block index within the file.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the extent holding the block cannot be split.
+ */
+static int osfs_block_mark_written(struct inode *inode, uint32_t block_index)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    int ret;
+
+    down_write(&osfs_inode->i_extent_sem);
+    ret = osfs_extent_set_flags(osfs_inode, block_index, 1, 0);
+    up_write(&osfs_inode->i_extent_sem);
+    if (!ret)
+        osfs_image_dirty_inode(inode->i_sb->s_fs_info, inode->i_ino);
+    return ret;
+}
+
+/**
+ * Function: osfs_fill_folio
+ * Description: Copies the data blocks backing a folio into it. Unallocated
+ *              blocks and the part of the folio beyond EOF read as zeros.
+ * Inputs:
+ *   - inode: The VFS inode owning the folio.
+ *   - folio: The locked folio to fill.
+ * Returns:
+ *   - None.
+ */
+static void osfs_fill_folio(struct inode *inode, struct folio *folio)
+{
+    unsigned int blocksize = i_blocksize(inode);
+    loff_t pos = folio_pos(folio);
+    loff_t isize = i_size_read(inode);
+    size_t offset;
+
+    for (offset = 0; offset < folio_size(folio); offset += blocksize) {
+        void *data_block = NULL;
+        void *kaddr;
+
+        if (pos + offset < isize)
+            data_block = osfs_block_data(inode, (pos + offset) >> inode->i_blkbits, NULL);
+
+        kaddr = kmap_local_folio(folio, offset);
+        if (data_block)
+            memcpy(kaddr, data_block, blocksize);
+        else
+            memset(kaddr, 0, blocksize);
+        kunmap_local(kaddr);
+    }
+    flush_dcache_folio(folio);
+}
+
+/**
+ * Function: osfs_read_folio
+ * Description: Brings a folio of file data into the page cache.
+ * Inputs:
+ *   - file: The file being read (may be NULL).
+ *   - folio: The locked folio to read into.
+ * Returns:
+ *   - 0 on success. The folio is marked uptodate and unlocked.
+ */
+static int osfs_read_folio(struct file *file, struct folio *folio)
+{
+    osfs_fill_folio(folio->mapping->host, folio);
+    folio_mark_uptodate(folio);
+    folio_unlock(folio);
+    return 0;
+}
+
+/**
+ * Function: osfs_alloc_range
+ * Description: Makes sure every data block under a byte range of a file is
+ *              allocated, so that a later writeback can never run out of space.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - pos: The file offset of the range.
+ *   - len: The length of the range, at least 1.
+ *   - flags: The extent flags of newly allocated blocks.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no free data block is available.
+ *   - -ENOMEM if a block or its mapping cannot be allocated.
+ */
+static int osfs_alloc_range(struct inode *inode, loff_t pos, loff_t len, uint32_t flags)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t block_no, mapped = 0;
+    uint64_t block_index;
+    int ret = 0;
+
+    down_write(&osfs_inode->i_extent_sem);
+    for (block_index = pos >> inode->i_blkbits;
+         block_index <= (pos + len - 1) >> inode->i_blkbits; block_index++) {
+        // 一次 lookup 就知道後面連續幾個 block 都已經分配
+        if (mapped == 0)
+            mapped = osfs_extent_lookup(osfs_inode, block_index, &block_no, NULL);
+        if (mapped > 0) {
+            mapped--;
+            continue;
+        }
+
+        ret = osfs_map_new_block(sb_info, osfs_inode, block_index, flags, &block_no);
+        if (ret)
+            break;
+        osfs_set_i_blocks(inode, osfs_inode);
+    }
+    up_write(&osfs_inode->i_extent_sem);
+    return ret;
+}
+
+/**
+ * Function: osfs_write_begin
+ * Description: Prepares a page cache folio for a buffered write and makes sure
+ *              every data block under the write range is allocated, so that a
+ *              later writeback can never run out of space.
+ * Inputs:
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: The file offset of the write.
+ *   - len: The number of bytes to write into this folio.
+ *   - pagep: Where to return the locked page.
+ *   - fsdata: Private data passed to osfs_write_end (unused).
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no free data block is available.
+ *   - -ENOMEM if the folio cannot be allocated.
+ */
+static int osfs_write_begin(struct file *file, struct address_space *mapping,
+                            loff_t pos, unsigned len,
+                            struct page **pagep, void **fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct folio *folio;
+    int ret;
+
+    folio = __filemap_get_folio(mapping, pos >> PAGE_SHIFT, FGP_WRITEBEGIN,
+                                mapping_gfp_mask(mapping));
+    if (IS_ERR(folio))
+        return PTR_ERR(folio);
+
+    // 部分覆寫時要先把舊資料讀進來，整頁覆寫就不用
+    if (!folio_test_uptodate(folio) && len != folio_size(folio))
+        osfs_fill_folio(inode, folio);
+
+    ret = osfs_alloc_range(inode, pos, len, 0);
+    if (ret)
+        goto out_unlock;
+
+    *pagep = &folio->page;
+    return 0;
+
+out_unlock:
+    folio_unlock(folio);
+    folio_put(folio);
+    return ret;
+}
+
+/**
+ * Function: osfs_write_end
+ * Description: Finishes a buffered write: marks the folio dirty and extends the
+ *              file size if the write went past EOF. A mapped page that held
+ *              the old EOF is then write-protected again, so a store into the
+ *              new part of it allocates its blocks through osfs_page_mkwrite.
+ * Inputs:
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: The file offset of the write.
+ *   - len: The number of bytes requested in osfs_write_begin.
+ *   - copied: The number of bytes actually copied from user space.
+ *   - page: The locked page returned by osfs_write_begin.
+ *   - fsdata: Private data from osfs_write_begin (unused).
+ * Returns:
+ *   - The number of bytes committed to the page cache.
+ */
+static int osfs_write_end(struct file *file, struct address_space *mapping,
+                          loff_t pos, unsigned len, unsigned copied,
+                          struct page *page, void *fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct folio *folio = page_folio(page);
+    loff_t old_size = inode->i_size;
+    loff_t last_pos = pos + copied;
+
+    // 整頁覆寫卻只複製了一部分，folio 內容不完整，讓 VFS 重試
+    if (!folio_test_uptodate(folio)) {
+        if (copied < len) {
+            copied = 0;
+            goto out;
+        }
+        folio_mark_uptodate(folio);
+    }
+
+    // 更新檔案大小
+    if (last_pos > inode->i_size) {
+        i_size_write(inode, last_pos);
+        osfs_inode->i_size = last_pos;
+        osfs_image_dirty_inode(inode->i_sb->s_fs_info, inode->i_ino);
+    }
+    folio_mark_dirty(folio);
+
+out:
+    folio_unlock(folio);
+    folio_put(folio);
+    // 原本 EOF 所在的 page 要重新 write-protect，之後 mmap 寫到新的範圍才會經過 page_mkwrite
+    if (inode->i_size > old_size)
+        pagecache_isize_extended(inode, old_size, inode->i_size);
+    return copied;
+}
+
+/**
+ * Function: osfs_writeback_folio
+ * Description: Copies a dirty folio back into the data blocks of its file.
+ *              Unwritten blocks become written once they hold the folio's data.
+ *              The part of the folio past EOF is zeroed first, so stray mmap
+ *              stores there never reach the last block.
+ * Inputs:
+ *   - folio: The locked folio to write back.
+ *   - wbc: The writeback control structure.
+ *   - data: Unused.
+ * Returns:
+ *   - 0 on success.
+ */
+static int osfs_writeback_folio(struct folio *folio, struct writeback_control *wbc, void *data)
+{
+    struct inode *inode = folio->mapping->host;
+    unsigned int blocksize = i_blocksize(inode);
+    loff_t pos = folio_pos(folio);
+    loff_t isize = i_size_read(inode);
+    size_t offset;
+    uint32_t flags;
+    int ret = 0, err;
+
+    // EOF 之後的部分可能有 mmap 寫進來的資料，清成 0 才不會存進 block
+    if (pos < isize && pos + folio_size(folio) > isize)
+        folio_zero_segment(folio, isize - pos, folio_size(folio));
+    folio_start_writeback(folio);
+    for (offset = 0; offset < folio_size(folio) && pos + offset < isize;
+         offset += blocksize) {
+        uint32_t block_index = (pos + offset) >> inode->i_blkbits;
+        void *data_block = osfs_block_data(inode, block_index, &flags);
+        void *kaddr;
+
+        // write_begin 已經先分配好 block，沒有 block 代表這段已被截斷
+        if (!data_block)
+            continue;
+
+        kaddr = kmap_local_folio(folio, offset);
+        memcpy(data_block, kaddr, blocksize);
+        kunmap_local(kaddr);
+
+        if (flags & OSFS_EXTENT_UNWRITTEN) {
+            err = osfs_block_mark_written(inode, block_index);
+            if (err && !ret)
+                ret = err;
+        }
+        osfs_block_dirty(inode, block_index);
+    }
+    if (ret)
+        mapping_set_error(folio->mapping, ret);
+    folio_unlock(folio);
+    folio_end_writeback(folio);
+    return ret;
+}
 
-    if (*ppos + len > osfs_inode->i_size)
-        len = osfs_inode->i_size - *ppos;
+/**
+ * Function: osfs_writepages
+ * Description: Writes back the dirty page cache folios of a file.
+ * Inputs:
+ *   - mapping: The address space to write back.
+ *   - wbc: The writeback control structure.
+ * Returns:
+ *   - 0 on success, or a negative error code from write_cache_pages.
+ */
+static int osfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    return write_cache_pages(mapping, wbc, osfs_writeback_folio, NULL);
+}
 
-    while (len > 0) {
-        // 1. 計算目前讀寫頭在哪一個 "邏輯 block" (第幾個格子)
-        uint32_t block_index = *ppos / BLOCK_SIZE;
-        // 2. 計算在該 block 內的偏移量
-        uint32_t offset_in_block = *ppos % BLOCK_SIZE;
-        // 3. 計算這次迴圈能讀多少 (不能超過目前 block 的剩餘空間)
-        size_t copy_len = BLOCK_SIZE - offset_in_block;
-        if (copy_len > len) copy_len = len;
+/**
+ * Struct: osfs_aops
+ * Description: Address space operations that serve regular file data from the
+ *              page cache, backed by the filesystem's data blocks.
+ */
+const struct address_space_operations osfs_aops = {
+    .read_folio = osfs_read_folio,
+    .write_begin = osfs_write_begin,
+    .write_end = osfs_write_end,
+    .writepages = osfs_writepages,
+    .dirty_folio = filemap_dirty_folio,
+};
 
-        // 4. 取得 "物理 block" 編號
-        uint32_t phy_block_no = osfs_inode->blocks[block_index];
-        
-        // 算出記憶體位置
-        data_block = sb_info->data_blocks + phy_block_no * BLOCK_SIZE + offset_in_block;
+/**
+ * Function: osfs_get_block
+ * Description: Maps a logical block of a file to its block on the device, for
+ *              the buffer head paths of block-device mode. Holes and unwritten
+ *              blocks stay unmapped when not creating, so they read as zeros.
+ *              With create set, a hole gets a new block and an unwritten block
+ *              becomes written; both are marked new, so the page cache zeroes
+ *              whatever the write does not cover before it reaches the device.
+ *              Their extents carry OSFS_EXTENT_NEW until
+ *              osfs_bdev_write_ordered has written the data back. A new block
+ *              is never one whose free is still uncommitted, so writeback
+ *              cannot land in a block the image maps to another file.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - iblock: The logical block.
+ *   - bh_result: The buffer head to map. A written block is mapped together
+ *                with the blocks after it, up to b_size bytes.
+ *   - create: Whether to allocate the block if it has no data yet.
+ * Returns:
+ *   - 0 on success.
+ *   - -EFBIG if iblock is past the last logical block.
+ *   - -ENOSPC if no free data block is available.
+ *   - -ENOMEM if the extent map cannot be updated.
+ */
+static int osfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result,
+                          int create)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    size_t max_blocks = max_t(size_t, bh_result->b_size >> inode->i_blkbits, 1);
+    uint32_t block_no, mapped, flags = 0;
+    int ret = 0;
 
-        // 複製給使用者
-        if (copy_to_user(buf, data_block, copy_len))
-            return -EFAULT;
+    if (iblock >= U32_MAX)
+        return -EFBIG;
 
-        // 更新變數，準備跑下一個 block (如果需要的話)
-        buf += copy_len;
-        *ppos += copy_len;
-        len -= copy_len;
-        bytes_read += copy_len;
+    down_read(&osfs_inode->i_extent_sem);
+    mapped = osfs_extent_lookup(osfs_inode, iblock, &block_no, &flags);
+    up_read(&osfs_inode->i_extent_sem);
+    if (mapped && !(flags & OSFS_EXTENT_UNWRITTEN)) {
+        map_bh(bh_result, inode->i_sb, osfs_disk_block(sb_info, block_no));
+        // 同一個 extent 後面的 block 一次對應，mpage 可以合成一個大 bio
+        bh_result->b_size = min_t(size_t, mapped, max_blocks) << inode->i_blkbits;
+        return 0;
     }
+    if (!create)
+        return 0;
+
+    // 資料寫回之前存成 unwritten，當機後才不會讀到裝置上原本的內容
+    down_write(&osfs_inode->i_extent_sem);
+    // 等 lock 的時候可能已經被別人分配或寫入
+    mapped = osfs_extent_lookup(osfs_inode, iblock, &block_no, &flags);
+    if (!mapped) {
+        ret = osfs_map_new_block(sb_info, osfs_inode, iblock, OSFS_EXTENT_NEW, &block_no);
+        if (!ret)
+            osfs_set_i_blocks(inode, osfs_inode);
+    } else if (flags & OSFS_EXTENT_UNWRITTEN) {
+        ret = osfs_extent_set_flags(osfs_inode, iblock, 1, OSFS_EXTENT_NEW);
+    }
+    up_write(&osfs_inode->i_extent_sem);
+    if (ret)
+        return ret;
+    if (mapped)
+        osfs_image_dirty_inode(sb_info, inode->i_ino);
+    set_bit(inode->i_ino, sb_info->image->ordered_inodes);
 
-    return bytes_read;
+    // 新分配或剛轉成 written 的 block，裝置上的內容都不能讀出來
+    if (!mapped || (flags & OSFS_EXTENT_UNWRITTEN))
+        set_buffer_new(bh_result);
+    map_bh(bh_result, inode->i_sb, osfs_disk_block(sb_info, block_no));
+    return 0;
 }
 
+// A write_begin covers at most one page, so at most this many blocks
+#define OSFS_WRITE_MAX_BLOCKS (PAGE_SIZE / OSFS_MIN_BLOCK_SIZE)
+
+/**
+ * Function: osfs_bdev_write_prepare
+ * Description: Records which blocks under a write past EOF are holes and
+ *              which are unwritten before osfs_bdev_write_begin maps them, so
+ *              that a failed write can undo only its own changes.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - pos: The file offset of the write.
+ *   - len: The length of the write, within one page.
+ *   - holes: Bitmap of the write's blocks, set for each hole.
+ *   - unwritten: Bitmap of the write's blocks, set for each unwritten block.
+ * Returns:
+ *   - None.
+ */
+static void osfs_bdev_write_prepare(struct inode *inode, loff_t pos, unsigned len,
+                                    unsigned long *holes, unsigned long *unwritten)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    uint64_t first = pos >> inode->i_blkbits;
+    uint64_t last = (pos + len - 1) >> inode->i_blkbits;
+    uint32_t block_no, flags = 0;
+    uint64_t lblk;
+
+    bitmap_zero(holes, OSFS_WRITE_MAX_BLOCKS);
+    bitmap_zero(unwritten, OSFS_WRITE_MAX_BLOCKS);
+    down_read(&osfs_inode->i_extent_sem);
+    for (lblk = first; lblk <= last && lblk <= U32_MAX; lblk++) {
+        if (!osfs_extent_lookup(osfs_inode, lblk, &block_no, &flags))
+            __set_bit(lblk - first, holes);
+        else if (flags & OSFS_EXTENT_UNWRITTEN)
+            __set_bit(lblk - first, unwritten);
+    }
+    up_read(&osfs_inode->i_extent_sem);
+}
 
 /**
- * Function: osfs_write
- * Description: Writes data to a file.
+ * Function: osfs_bdev_write_failed
+ * Description: Undoes what a failed write did to its blocks past EOF. Blocks
+ *              it allocated are freed, and blocks fallocate had reserved go
+ *              back to unwritten. Nothing was written to either, so keeping
+ *              them as they are would let a later truncate up read whatever
+ *              the device held there. Blocks mapped before the write are kept.
  * Inputs:
- *   - filp: The file pointer representing the file to write to.
- *   - buf: The user-space buffer containing the data to write.
- *   - len: The number of bytes to write.
- *   - ppos: The file position pointer.
+ *   - inode: The VFS inode of the file.
+ *   - pos: The file offset of the write.
+ *   - len: The length of the write.
+ *   - holes: The holes recorded by osfs_bdev_write_prepare.
+ *   - unwritten: The unwritten blocks recorded by osfs_bdev_write_prepare.
  * Returns:
- *   - The number of bytes written on success.
- *   - -EFAULT if copying data from user space fails.
- *   - Adjusted length if the write exceeds the block size.
+ *   - None.
  */
-static ssize_t osfs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
-{   
-    struct inode *inode = file_inode(filp);
-    struct osfs_inode *osfs_inode = inode->i_private;
+static void osfs_bdev_write_failed(struct inode *inode, loff_t pos, unsigned len,
+                                   const unsigned long *holes, const unsigned long *unwritten)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
-    void *data_block;
-    ssize_t bytes_written = 0;
+    loff_t isize = i_size_read(inode);
+    uint64_t start = pos >> inode->i_blkbits;
+    uint64_t first = max_t(uint64_t, start, round_up(isize, i_blocksize(inode)) >> inode->i_blkbits);
+    uint64_t last = (pos + len - 1) >> inode->i_blkbits;
+    uint64_t lblk;
+
+    if (pos + len <= isize || first > last)
+        return;
+    truncate_pagecache(inode, isize);
+    osfs_meta_begin(sb_info);
+    down_write(&osfs_inode->i_extent_sem);
+    for (lblk = first; lblk <= last && lblk <= U32_MAX; lblk++) {
+        if (test_bit(lblk - start, holes))
+            osfs_extent_remove(sb_info, osfs_inode, lblk, 1);
+        else if (test_bit(lblk - start, unwritten))
+            osfs_extent_set_flags(osfs_inode, lblk, 1, OSFS_EXTENT_UNWRITTEN);
+    }
+    osfs_set_i_blocks(inode, osfs_inode);
+    up_write(&osfs_inode->i_extent_sem);
+    osfs_meta_end(sb_info);
+    osfs_image_dirty_inode(sb_info, inode->i_ino);
+}
+
+/**
+ * Function: osfs_bdev_write_begin
+ * Description: Prepares a page cache folio for a buffered write in
+ *              block-device mode. Blocks under the write are allocated, and
+ *              partially written blocks are read from the device first.
+ * Inputs:
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: The file offset of the write.
+ *   - len: The number of bytes to write into this folio.
+ *   - pagep: Where to return the locked page.
+ *   - fsdata: Private data passed to osfs_bdev_write_end (unused).
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from block_write_begin on failure.
+ */
+static int osfs_bdev_write_begin(struct file *file, struct address_space *mapping,
+                                 loff_t pos, unsigned len,
+                                 struct page **pagep, void **fsdata)
+{
+    DECLARE_BITMAP(holes, OSFS_WRITE_MAX_BLOCKS);
+    DECLARE_BITMAP(unwritten, OSFS_WRITE_MAX_BLOCKS);
+    struct inode *inode = mapping->host;
+    // i_rwsem 擋住其他寫入和 fallocate，EOF 之後的 mapping 在這段期間不會變
+    bool past_eof = pos + len > i_size_read(inode);
     int ret;
 
-    while (len > 0) {
-        // 1. 計算目前在哪個邏輯 block
-        uint32_t block_index = *ppos / BLOCK_SIZE;
-        uint32_t offset_in_block = *ppos % BLOCK_SIZE;
-        size_t copy_len = BLOCK_SIZE - offset_in_block;
-        if (copy_len > len) copy_len = len;
-
-        // 2. 檢查是否超過檔案大小限制 (Bonus 限制最多 5 個 blocks)
-        if (block_index >= MAX_BLOCKS_PER_FILE) {
-            if (bytes_written > 0) return bytes_written; // 已經寫了一些就回傳成功的部分
-            return -ENOSPC; // 空間不足
+    if (past_eof)
+        osfs_bdev_write_prepare(inode, pos, len, holes, unwritten);
+    ret = block_write_begin(mapping, pos, len, pagep, osfs_get_block);
+    if (ret && past_eof)
+        osfs_bdev_write_failed(inode, pos, len, holes, unwritten);
+    return ret;
+}
+
+/**
+ * Function: osfs_bdev_write_end
+ * Description: Finishes a buffered write in block-device mode and records a
+ *              new file size in the inode table.
+ * Inputs:
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: The file offset of the write.
+ *   - len: The number of bytes requested in osfs_bdev_write_begin.
+ *   - copied: The number of bytes actually copied from user space.
+ *   - page: The locked page returned by osfs_bdev_write_begin.
+ *   - fsdata: Private data from osfs_bdev_write_begin (unused).
+ * Returns:
+ *   - The number of bytes committed to the page cache.
+ */
+static int osfs_bdev_write_end(struct file *file, struct address_space *mapping,
+                               loff_t pos, unsigned len, unsigned copied,
+                               struct page *page, void *fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    int ret;
+
+    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    // generic_write_end 已經更新 i_size
+    if (osfs_inode->i_size != i_size_read(inode)) {
+        osfs_inode->i_size = i_size_read(inode);
+        osfs_image_dirty_inode(inode->i_sb->s_fs_info, inode->i_ino);
+    }
+    return ret;
+}
+
+static int osfs_bdev_read_folio(struct file *file, struct folio *folio)
+{
+    return mpage_read_folio(folio, osfs_get_block);
+}
+
+static void osfs_bdev_readahead(struct readahead_control *rac)
+{
+    mpage_readahead(rac, osfs_get_block);
+}
+
+static int osfs_bdev_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    return mpage_writepages(mapping, wbc, osfs_get_block);
+}
+
+/**
+ * Struct: osfs_bdev_aops
+ * Description: Address space operations for regular files in block-device
+ *              mode. File data is cached with buffer heads and read and
+ *              written in place in the device's data area.
+ */
+const struct address_space_operations osfs_bdev_aops = {
+    .read_folio = osfs_bdev_read_folio,
+    .readahead = osfs_bdev_readahead,
+    .write_begin = osfs_bdev_write_begin,
+    .write_end = osfs_bdev_write_end,
+    .writepages = osfs_bdev_writepages,
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = block_invalidate_folio,
+    .migrate_folio = buffer_migrate_folio,
+    .is_partially_uptodate = block_is_partially_uptodate,
+};
+
+/**
+ * Function: osfs_bdev_write_ordered
+ * Description: Writes back the data of the files that got blocks since the
+ *              last journal commit in block-device mode, then clears
+ *              OSFS_EXTENT_NEW from their extents so the next commit saves
+ *              them as written. Until then they are saved as unwritten, and
+ *              after a crash read as zeros instead of whatever the device
+ *              held. Writes and page faults of each file are held off while
+ *              it is written back, so every block allocated by then has its
+ *              folio dirty. Called with commit_mutex held, before the commit
+ *              takes ckpt_sem.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - true if any extent became written, so the data must be flushed before
+ *     the commit that saves it.
+ */
+bool osfs_bdev_write_ordered(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    struct osfs_inode *osfs_inode;
+    struct inode *inode;
+    bool cleared = false;
+    unsigned long ino;
+    int ret;
+
+    lockdep_assert_held(&image->commit_mutex);
+    if (!sb_info->bdev)
+        return false;
+
+    for_each_set_bit(ino, image->ordered_inodes, sb_info->inode_count) {
+        if (!test_and_clear_bit(ino, image->ordered_inodes))
+            continue;
+        osfs_inode = &((struct osfs_inode *)sb_info->inode_table)[ino];
+        // 已經被 evict 的 inode，資料在 evict 之前就寫回了
+        inode = ilookup(sb_info->sb, ino);
+        if (inode) {
+            inode_lock(inode);
+            filemap_invalidate_lock(inode->i_mapping);
+            ret = filemap_write_and_wait(inode->i_mapping);
+        } else {
+            ret = 0;
+        }
+        // 寫回失敗的 block 留在 unwritten
+        if (!ret) {
+            down_write(&osfs_inode->i_extent_sem);
+            if (osfs_extent_clear_new(osfs_inode)) {
+                osfs_image_dirty_inode(sb_info, ino);
+                cleared = true;
+            }
+            up_write(&osfs_inode->i_extent_sem);
+        }
+        if (inode) {
+            filemap_invalidate_unlock(inode->i_mapping);
+            inode_unlock(inode);
+            iput(inode);
+        }
+    }
+    return cleared;
+}
+
+/**
+ * Function: osfs_range_mapped_nowait
+ * Description: Checks without sleeping whether every block under a byte range
+ *              of a file is already allocated.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - pos: The file offset of the range.
+ *   - len: The length of the range, at least 1.
+ * Returns:
+ *   - true if the whole range is mapped.
+ *   - false if it has a hole or the block map is busy.
+ */
+static bool osfs_range_mapped_nowait(struct inode *inode, loff_t pos, size_t len)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    uint32_t block_index = pos >> inode->i_blkbits;
+    uint32_t last = (pos + len - 1) >> inode->i_blkbits;
+    uint32_t block_no, mapped;
+    bool ret = true;
+
+    if (!down_read_trylock(&osfs_inode->i_extent_sem))
+        return false;
+    while (block_index <= last) {
+        mapped = osfs_extent_lookup(osfs_inode, block_index, &block_no, NULL);
+        if (!mapped) {
+            ret = false;
+            break;
         }
+        // mapped 是從 block_index 開始連續的 block 數，一次跳過
+        if (mapped > last - block_index)
+            break;
+        block_index += mapped;
+    }
+    up_read(&osfs_inode->i_extent_sem);
+    return ret;
+}
 
-        // 3. 如果這個 block 還沒分配，就分配一個
-        if (osfs_inode->blocks[block_index] == 0) {
-             // 這裡做一個簡單檢查：如果是 Block 0 但值是 0，可能是剛初始化。
-             // 嚴謹一點應該用 i_blocks 計數，但這邊簡化處理：
-             // 只要該 slot 是 0，就代表還沒分配實體空間
-            ret = osfs_alloc_data_block(sb_info, &osfs_inode->blocks[block_index]);
-            if (ret) {
-                if (bytes_written > 0) return bytes_written;
-                return ret; 
+/**
+ * Function: osfs_file_write_iter
+ * Description: Buffered write entry point. Same as generic_file_write_iter,
+ *              except that an IOCB_NOWAIT write fails with -EAGAIN instead of
+ *              waiting for the inode lock or allocating data blocks, so
+ *              io_uring can complete writes to allocated ranges inline. In
+ *              block-device mode every IOCB_NOWAIT write fails that way,
+ *              since a partial block write may have to read the device. A
+ *              write that runs out of space is retried once after a journal
+ *              commit gives back the blocks of deleted data.
+ * Inputs:
+ *   - iocb: The I/O control block of the write.
+ *   - from: The data to write.
+ * Returns:
+ *   - The number of bytes written.
+ *   - -EAGAIN if IOCB_NOWAIT is set and the write would block.
+ *   - Another negative error code on failure.
+ */
+static ssize_t osfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    bool retried = false;
+    ssize_t ret;
+
+retry:
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock(inode);
+    }
+
+    ret = generic_write_checks(iocb, from);
+    if (ret > 0 && (iocb->ki_flags & IOCB_NOWAIT) &&
+        (inode->i_sb->s_bdev || !osfs_range_mapped_nowait(inode, iocb->ki_pos, ret)))
+        ret = -EAGAIN;
+    if (ret > 0)
+        ret = __generic_file_write_iter(iocb, from);
+    inode_unlock(inode);
+
+    // 刪掉的檔案 commit 之後 block 才會放回來，commit 一次再試
+    if (ret == -ENOSPC && !retried && !(iocb->ki_flags & IOCB_NOWAIT) &&
+        osfs_journal_retry_alloc(inode->i_sb->s_fs_info)) {
+        retried = true;
+        goto retry;
+    }
+
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+/**
+ * Function: osfs_file_open
+ * Description: Opens a regular file and advertises non-blocking I/O support.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - file: The file being opened.
+ * Returns:
+ *   - 0 on success, or a negative error code from generic_file_open.
+ */
+static int osfs_file_open(struct inode *inode, struct file *file)
+{
+    // read_iter 和 write_iter 都會處理 IOCB_NOWAIT
+    file->f_mode |= FMODE_NOWAIT;
+    return generic_file_open(inode, file);
+}
+
+/**
+ * Function: osfs_page_mkwrite
+ * Description: Called when a page of a shared mapping is about to become
+ *              writable. Allocates the data blocks under the page the same way
+ *              osfs_write_begin does, or in block-device mode the way
+ *              osfs_bdev_write_begin does, then dirties it.
+ * Inputs:
+ *   - vmf: The fault being handled.
+ * Returns:
+ *   - VM_FAULT_LOCKED with the folio locked and dirty on success.
+ *   - VM_FAULT_NOPAGE if the folio was truncated meanwhile.
+ *   - VM_FAULT_SIGBUS or VM_FAULT_OOM if the blocks cannot be allocated.
+ */
+static vm_fault_t osfs_page_mkwrite(struct vm_fault *vmf)
+{
+    struct folio *folio = page_folio(vmf->page);
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    vm_fault_t ret = VM_FAULT_LOCKED;
+    loff_t size;
+    int err;
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vmf->vma->vm_file);
+    // 和 fallocate、truncate 互斥，它們拿 invalidate_lock 的 exclusive lock
+    filemap_invalidate_lock_shared(inode->i_mapping);
+
+    // buffer head 的版本自己處理 folio lock 和截斷
+    if (inode->i_sb->s_bdev) {
+        ret = block_page_mkwrite_return(block_page_mkwrite(vmf->vma, vmf, osfs_get_block));
+        goto out;
+    }
+
+    folio_lock(folio);
+    size = i_size_read(inode);
+    // 等 lock 的時候 folio 可能已經被截斷
+    if (folio->mapping != inode->i_mapping || folio_pos(folio) >= size) {
+        folio_unlock(folio);
+        ret = VM_FAULT_NOPAGE;
+        goto out;
+    }
+
+    err = osfs_alloc_range(inode, folio_pos(folio),
+                           min_t(loff_t, folio_size(folio), size - folio_pos(folio)), 0);
+    if (err) {
+        folio_unlock(folio);
+        ret = vmf_error(err);
+        goto out;
+    }
+
+    folio_mark_dirty(folio);
+    folio_wait_stable(folio);
+out:
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
+
+static const struct vm_operations_struct osfs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = osfs_page_mkwrite,
+};
+
+/**
+ * Function: osfs_file_mmap
+ * Description: Maps a regular file. Faults are served from the page cache;
+ *              writes through a shared mapping reach the data blocks on writeback.
+ * Inputs:
+ *   - file: The file being mapped.
+ *   - vma: The new mapping.
+ * Returns:
+ *   - 0 on success.
+ */
+static int osfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    file_accessed(file);
+    vma->vm_ops = &osfs_file_vm_ops;
+    return 0;
+}
+
+/**
+ * Function: osfs_copy_blocks
+ * Description: Copies a byte range between two osfs files block by block,
+ *              straight from the source's data blocks into the destination's.
+ *              Holes in the source stay holes in the destination unless the
+ *              destination already has written blocks there, which are zeroed.
+ *              Called with both inodes locked and their page cache written back.
+ * Inputs:
+ *   - inode_in: The source inode.
+ *   - pos_in: The block-aligned source offset.
+ *   - inode_out: The destination inode.
+ *   - pos_out: The block-aligned destination offset.
+ *   - len: The number of bytes to copy.
+ * Returns:
+ *   - The number of bytes copied, which is len unless an allocation failed.
+ *   - A negative error code if nothing could be copied.
+ */
+static ssize_t osfs_copy_blocks(struct inode *inode_in, loff_t pos_in,
+                                struct inode *inode_out, loff_t pos_out, size_t len)
+{
+    unsigned int blocksize = i_blocksize(inode_out);
+    size_t done = 0, n;
+    uint32_t block_out, flags;
+    void *src, *dst;
+    int ret;
+
+    while (done < len) {
+        n = min_t(size_t, blocksize, len - done);
+        flags = 0;
+        block_out = (pos_out + done) >> inode_out->i_blkbits;
+        src = osfs_block_data(inode_in, (pos_in + done) >> inode_in->i_blkbits, NULL);
+        dst = osfs_block_data(inode_out, block_out, &flags);
+
+        if (src && !dst) {
+            ret = osfs_alloc_range(inode_out, pos_out + done, n, 0);
+            if (ret)
+                return done ? done : ret;
+            dst = osfs_block_data(inode_out, block_out, &flags);
+        }
+
+        if (flags & OSFS_EXTENT_UNWRITTEN) {
+            // unwritten block 本來就讀成 0，有資料寫進去時才把剩下的部分清 0
+            if (src) {
+                memcpy(dst, src, n);
+                memset(dst + n, 0, blocksize - n);
+                ret = osfs_block_mark_written(inode_out, block_out);
+                if (ret)
+                    return done ? done : ret;
+                osfs_block_dirty(inode_out, block_out);
             }
-            osfs_inode->i_blocks++;
-            // 清空新分配的記憶體
-            memset(sb_info->data_blocks + osfs_inode->blocks[block_index] * BLOCK_SIZE, 0, BLOCK_SIZE);
+        } else if (src) {
+            memcpy(dst, src, n);
+            osfs_block_dirty(inode_out, block_out);
+        } else if (dst) {
+            memset(dst, 0, n);
+            osfs_block_dirty(inode_out, block_out);
         }
+        done += n;
+    }
+    return done;
+}
 
-        // 4. 寫入資料
-        data_block = sb_info->data_blocks + osfs_inode->blocks[block_index] * BLOCK_SIZE + offset_in_block;
-        
-        if (copy_from_user(data_block, buf, copy_len)) {
-            return -EFAULT;
+/**
+ * Function: osfs_copy_file_range
+ * Description: Copies data between two files of the same osfs mount without
+ *              passing it through user space or the page cache. Ranges that
+ *              do not start on a block boundary, and files on a block device,
+ *              whose data is not in the data pool, go through splice instead.
+ * Inputs:
+ *   - file_in: The source file.
+ *   - pos_in: The source offset.
+ *   - file_out: The destination file.
+ *   - pos_out: The destination offset.
+ *   - len: The number of bytes to copy, already clamped to the source size.
+ *   - flags: Must be 0.
+ * Returns:
+ *   - The number of bytes copied.
+ *   - A negative error code on failure.
+ */
+static ssize_t osfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                                    struct file *file_out, loff_t pos_out,
+                                    size_t len, unsigned int flags)
+{
+    struct inode *inode_in = file_inode(file_in);
+    struct inode *inode_out = file_inode(file_out);
+    struct osfs_inode *osfs_inode_out = OSFS_I(inode_out)->i_raw;
+    unsigned int blocksize = i_blocksize(inode_out);
+    ssize_t ret;
+
+    if (flags)
+        return -EINVAL;
+    if (inode_in->i_sb != inode_out->i_sb || inode_in->i_sb->s_bdev ||
+        !IS_ALIGNED(pos_in, blocksize) || !IS_ALIGNED(pos_out, blocksize))
+        return splice_copy_file_range(file_in, pos_in, file_out, pos_out, len);
+    if (len == 0)
+        return 0;
+
+    lock_two_nondirectories(inode_in, inode_out);
+
+    ret = file_modified(file_out);
+    if (ret)
+        goto out_unlock;
+
+    // 先把兩邊的 dirty page 寫回 data block，block 裡才是最新的資料
+    ret = filemap_write_and_wait_range(inode_in->i_mapping, pos_in, pos_in + len - 1);
+    if (!ret)
+        ret = filemap_write_and_wait_range(inode_out->i_mapping, pos_out, pos_out + len - 1);
+    if (ret)
+        goto out_unlock;
+
+    ret = osfs_copy_blocks(inode_in, pos_in, inode_out, pos_out, len);
+    if (ret <= 0)
+        goto out_unlock;
+
+    if (pos_out + ret > i_size_read(inode_out)) {
+        i_size_write(inode_out, pos_out + ret);
+        osfs_inode_out->i_size = pos_out + ret;
+        osfs_image_dirty_inode(inode_out->i_sb->s_fs_info, inode_out->i_ino);
+    }
+    // 目的端的 page cache 已經過時，丟掉讓下次從 block 讀
+    invalidate_inode_pages2_range(inode_out->i_mapping, pos_out >> PAGE_SHIFT,
+                                  (pos_out + ret - 1) >> PAGE_SHIFT);
+
+out_unlock:
+    unlock_two_nondirectories(inode_in, inode_out);
+    return ret;
+}
+
+/**
+ * Function: osfs_zero_block_range
+ * Description: Zeroes part of a written data block. A block in the data pool
+ *              is zeroed in place. On a block device the zeros go through the
+ *              page cache and reach the block on writeback; only the part
+ *              below EOF is zeroed, since writeback zeroes the rest of the
+ *              last block. Holes and unwritten blocks already read as zeros
+ *              and are left alone. Called after the page cache of the range
+ *              has been truncated.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - pos: The file offset to start zeroing at.
+ *   - len: The number of bytes to zero, within the block holding pos.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code if the block cannot be read from the device.
+ */
+static int osfs_zero_block_range(struct inode *inode, loff_t pos, size_t len)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    uint32_t block_no, mapped, flags = 0;
+    void *data_block;
+    struct page *page;
+    int ret;
+
+    if (!inode->i_sb->s_bdev) {
+        data_block = osfs_block_data(inode, pos >> inode->i_blkbits, NULL);
+        if (data_block) {
+            memset(data_block + (pos & (i_blocksize(inode) - 1)), 0, len);
+            osfs_block_dirty(inode, pos >> inode->i_blkbits);
         }
+        return 0;
+    }
 
-        // 5. 更新狀態
-        buf += copy_len;
-        *ppos += copy_len;
-        len -= copy_len;
-        bytes_written += copy_len;
+    if (pos >= i_size_read(inode))
+        return 0;
+    len = min_t(loff_t, len, i_size_read(inode) - pos);
+    down_read(&osfs_inode->i_extent_sem);
+    mapped = osfs_extent_lookup(osfs_inode, pos >> inode->i_blkbits, &block_no, &flags);
+    up_read(&osfs_inode->i_extent_sem);
+    if (!mapped || (flags & OSFS_EXTENT_UNWRITTEN))
+        return 0;
+
+    // 和一般寫入一樣經過 write_begin，只有這段的 buffer 會變 dirty
+    ret = block_write_begin(inode->i_mapping, pos, len, &page, osfs_get_block);
+    if (ret)
+        return ret;
+    zero_user(page, offset_in_page(pos), len);
+    ret = generic_write_end(NULL, inode->i_mapping, pos, len, len, page, NULL);
+    return ret < 0 ? ret : 0;
+}
 
-        // 更新檔案大小
-        if (*ppos > osfs_inode->i_size) {
-            osfs_inode->i_size = *ppos;
-            inode->i_size = *ppos;
+/**
+ * Function: osfs_punch_hole
+ * Description: Makes a byte range of a file read as zeros. Whole blocks in the
+ *              range are unmapped and freed; the partial blocks at either end
+ *              are zeroed. Called with the inode and its invalidate_lock held.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - offset: The start of the range.
+ *   - len: The length of the range, at least 1.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    unsigned int blocksize = i_blocksize(inode);
+    loff_t end = offset + len;
+    loff_t first_full = round_up(offset, blocksize);
+    loff_t last_full = round_down(end, blocksize);
+    int ret;
+
+    // 先寫回，才不會有 dirty page 之後又把舊資料寫進 block
+    ret = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+    if (ret)
+        return ret;
+    // invalidate_lock 擋住讀取，清 block 之前 page cache 不會再被填回舊資料
+    truncate_pagecache_range(inode, offset, end - 1);
+
+    if (first_full > last_full) {
+        // 整個範圍都在同一個 block 裡
+        ret = osfs_zero_block_range(inode, offset, len);
+    } else {
+        if (offset < first_full)
+            ret = osfs_zero_block_range(inode, offset, first_full - offset);
+        if (!ret && last_full < end)
+            ret = osfs_zero_block_range(inode, last_full, end - last_full);
+    }
+
+    if (ret || first_full >= last_full)
+        return ret;
+    osfs_meta_begin(sb_info);
+    down_write(&osfs_inode->i_extent_sem);
+    ret = osfs_extent_remove(sb_info, osfs_inode, first_full >> inode->i_blkbits,
+                             (last_full - first_full) >> inode->i_blkbits);
+    osfs_set_i_blocks(inode, osfs_inode);
+    up_write(&osfs_inode->i_extent_sem);
+    osfs_meta_end(sb_info);
+    return ret;
+}
+
+/**
+ * Function: osfs_collapse_range
+ * Description: Removes a block-aligned byte range from a file and moves the
+ *              rest of the file down to fill the gap. Called with the inode
+ *              and its invalidate_lock held.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - offset: The start of the range.
+ *   - len: The length of the range, at least 1.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the range is not block-aligned or reaches EOF.
+ *   - Another negative error code on failure.
+ */
+static int osfs_collapse_range(struct inode *inode, loff_t offset, loff_t len)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    loff_t page_start = round_down(offset, PAGE_SIZE);
+    loff_t new_size;
+    int ret;
+
+    if (!IS_ALIGNED(offset | len, i_blocksize(inode)))
+        return -EINVAL;
+    if (offset + len >= i_size_read(inode))
+        return -EINVAL;
+
+    // offset 之後的資料都會搬動，整段寫回後丟掉 page cache
+    ret = filemap_write_and_wait_range(inode->i_mapping, page_start, LLONG_MAX);
+    if (ret)
+        return ret;
+    truncate_pagecache(inode, page_start);
+
+    osfs_meta_begin(sb_info);
+    down_write(&osfs_inode->i_extent_sem);
+    ret = osfs_extent_remove(sb_info, osfs_inode, offset >> inode->i_blkbits,
+                             len >> inode->i_blkbits);
+    if (!ret)
+        osfs_extent_shift(osfs_inode, (offset + len) >> inode->i_blkbits,
+                          len >> inode->i_blkbits);
+    osfs_set_i_blocks(inode, osfs_inode);
+    up_write(&osfs_inode->i_extent_sem);
+    osfs_meta_end(sb_info);
+    if (ret)
+        return ret;
+
+    new_size = i_size_read(inode) - len;
+    i_size_write(inode, new_size);
+    osfs_inode->i_size = new_size;
+    osfs_image_dirty_inode(sb_info, inode->i_ino);
+    return 0;
+}
+
+/**
+ * Function: osfs_fallocate
+ * Description: Manipulates the space of a file without writing data.
+ *              Preallocated blocks are marked unwritten, so they read as zeros
+ *              without being cleared, and are used by later writes without
+ *              allocating on the write path.
+ * Inputs:
+ *   - file: The file.
+ *   - mode: 0 or a combination of FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE,
+ *           FALLOC_FL_ZERO_RANGE and FALLOC_FL_COLLAPSE_RANGE.
+ *   - offset: The start of the range.
+ *   - len: The length of the range.
+ * Returns:
+ *   - 0 on success.
+ *   - -EOPNOTSUPP for other modes.
+ *   - -ENOSPC if the range cannot be fully preallocated, even after a
+ *     journal commit gives back the blocks of deleted data. Blocks allocated
+ *     so far stay allocated.
+ *   - Another negative error code on failure.
+ */
+static long osfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    loff_t end = offset + len;
+    bool retried = false;
+    long ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+                 FALLOC_FL_ZERO_RANGE | FALLOC_FL_COLLAPSE_RANGE))
+        return -EOPNOTSUPP;
+
+retry:
+    inode_lock(inode);
+    if (!(mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_COLLAPSE_RANGE)) && end > i_size_read(inode)) {
+        ret = inode_newsize_ok(inode, end);
+        if (ret)
+            goto out_unlock;
+    }
+    ret = file_modified(file);
+    if (ret)
+        goto out_unlock;
+
+    // 擋住 page fault，避免 mmap 在處理途中又把 page 讀回來或弄髒
+    filemap_invalidate_lock(inode->i_mapping);
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        ret = osfs_punch_hole(inode, offset, len);
+    } else if (mode & FALLOC_FL_COLLAPSE_RANGE) {
+        ret = osfs_collapse_range(inode, offset, len);
+    } else {
+        // ZERO_RANGE 先挖洞，再把洞預先分配成 unwritten block
+        if (mode & FALLOC_FL_ZERO_RANGE)
+            ret = osfs_punch_hole(inode, offset, len);
+        if (!ret)
+            ret = osfs_alloc_range(inode, offset, len, OSFS_EXTENT_UNWRITTEN);
+        if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+            i_size_write(inode, end);
+            osfs_inode->i_size = end;
+            osfs_image_dirty_inode(inode->i_sb->s_fs_info, inode->i_ino);
         }
     }
-    
-    // 更新時間
-    inode_set_mtime_to_ts(inode, current_time(inode));
-    inode_set_ctime_to_ts(inode, current_time(inode));
-    mark_inode_dirty(inode);
+    filemap_invalidate_unlock(inode->i_mapping);
+
+out_unlock:
+    inode_unlock(inode);
+    // 裝置模式的 commit 要拿檔案的 lock 寫回資料，放掉 lock 之後才能 commit
+    if (ret == -ENOSPC && !retried && !(mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_COLLAPSE_RANGE)) &&
+        osfs_journal_retry_alloc(inode->i_sb->s_fs_info)) {
+        retried = true;
+        goto retry;
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_seek_data_hole
+ * Description: Implements SEEK_DATA and SEEK_HOLE from the extent map. Holes
+ *              are unmapped ranges; unwritten extents count as holes except
+ *              where the page cache already holds data for them.
+ * Inputs:
+ *   - file: The file.
+ *   - offset: Where to start looking.
+ *   - whence: SEEK_DATA or SEEK_HOLE.
+ * Returns:
+ *   - The new file position.
+ *   - -ENXIO if offset is at or past EOF, or SEEK_DATA finds no data.
+ */
+static loff_t osfs_seek_data_hole(struct file *file, loff_t offset, int whence)
+{
+    struct inode *inode = file->f_mapping->host;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct osfs_extent ext;
+    loff_t isize, pos, ext_start, ext_end, found;
+    loff_t ret = -ENXIO;
+    bool mapped;
+
+    inode_lock_shared(inode);
+    isize = i_size_read(inode);
+    if (offset < 0 || offset >= isize)
+        goto out_unlock;
+
+    for (pos = offset; pos < isize; pos = ext_end) {
+        down_read(&osfs_inode->i_extent_sem);
+        mapped = osfs_extent_find(osfs_inode, pos >> inode->i_blkbits, &ext);
+        up_read(&osfs_inode->i_extent_sem);
+
+        // 後面沒有 extent 了，到 EOF 都是 hole
+        if (!mapped)
+            break;
+
+        ext_start = (loff_t)ext.e_lblk << inode->i_blkbits;
+        ext_end = min_t(loff_t, ((loff_t)ext.e_lblk + ext.e_len) << inode->i_blkbits, isize);
+        if (ext_start > pos) {
+            // pos 落在 hole 裡
+            if (whence == SEEK_HOLE) {
+                ret = pos;
+                goto out_unlock;
+            }
+            pos = ext_start;
+            if (pos >= isize)
+                break;
+        }
+
+        if (ext.e_flags & OSFS_EXTENT_UNWRITTEN) {
+            // unwritten 的範圍只有 page cache 裡有的部分算資料
+            found = mapping_seek_hole_data(file->f_mapping, pos, ext_end, whence);
+            if (found >= 0 && found < ext_end) {
+                ret = found;
+                goto out_unlock;
+            }
+        } else if (whence == SEEK_DATA) {
+            ret = pos;
+            goto out_unlock;
+        }
+    }
+    // 找到 EOF 都沒有結果：SEEK_HOLE 停在 EOF，SEEK_DATA 回 -ENXIO
+    if (whence == SEEK_HOLE)
+        ret = isize;
 
-    return bytes_written;
+out_unlock:
+    inode_unlock_shared(inode);
+    if (ret < 0)
+        return ret;
+    return vfs_setpos(file, ret, inode->i_sb->s_maxbytes);
+}
+
+/**
+ * Function: osfs_file_llseek
+ * Description: Repositions the file offset, with SEEK_DATA and SEEK_HOLE
+ *              answered from the extent map.
+ * Inputs:
+ *   - file: The file.
+ *   - offset: The offset argument of lseek.
+ *   - whence: The whence argument of lseek.
+ * Returns:
+ *   - The new file position, or a negative error code.
+ */
+static loff_t osfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+    if (whence == SEEK_DATA || whence == SEEK_HOLE)
+        return osfs_seek_data_hole(file, offset, whence);
+    return generic_file_llseek(file, offset, whence);
+}
+
+/**
+ * Function: osfs_fsync
+ * Description: Writes back the dirty pages and attributes of a file or
+ *              directory and commits the journal, so that the file and every
+ *              namespace change made before the call are on the image.
+ *              Concurrent calls share one journal commit.
+ * Inputs:
+ *   - file: The file to sync.
+ *   - start: The first byte of the range to write back.
+ *   - end: The last byte of the range to write back.
+ *   - datasync: Whether only the data and the size must be synced.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writeback or the commit on failure.
+ */
+int osfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    int ret;
+
+    ret = __generic_file_fsync(file, start, end, datasync);
+    if (ret)
+        return ret;
+    return osfs_journal_commit(file_inode(file)->i_sb->s_fs_info);
 }
 
 /**
@@ -142,18 +1348,111 @@ static ssize_t osfs_write(struct file *filp, const char __user *buf, size_t len,
  * Description: Defines the file operations for regular files in osfs.
  */
 const struct file_operations osfs_file_operations = {
-    .open = generic_file_open, // Use generic open or implement osfs_open if needed
-    .read = osfs_read,
-    .write = osfs_write,
-    .llseek = default_llseek,
+    .open = osfs_file_open,
+    .read_iter = generic_file_read_iter,
+    .write_iter = osfs_file_write_iter,
+    .llseek = osfs_file_llseek,
+    .mmap = osfs_file_mmap,
+    .fsync = osfs_fsync,
+    .splice_read = filemap_splice_read,
+    .splice_write = iter_file_splice_write,
+    .copy_file_range = osfs_copy_file_range,
+    .fallocate = osfs_fallocate,
     // Add other operations as needed
 };
 
+/**
+ * Function: osfs_setsize
+ * Description: Changes the size of a file. Blocks past the new EOF are freed
+ *              right away, and the part of the last block past EOF is zeroed
+ *              so that growing the file again reads zeros there. Called with
+ *              the inode and its invalidate_lock held.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - new_size: The new file size.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the extent straddling the new EOF cannot be split. The size
+ *     has changed but the blocks past it stay allocated.
+ *   - A negative error code if the last block cannot be read from the device.
+ *     The size is unchanged.
+ */
+static int osfs_setsize(struct inode *inode, loff_t new_size)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    unsigned int blocksize = i_blocksize(inode);
+    loff_t old_size = i_size_read(inode);
+    loff_t tail = min(old_size, new_size);
+    loff_t tail_end = round_up(tail, blocksize);
+    uint64_t first_free = tail_end >> inode->i_blkbits;
+    int ret = 0;
+
+    // 縮小時是新 EOF 之後、變大時是舊 EOF 之後的部分，先清 page cache 再清 block，
+    // 清 page cache 時會等正在進行的 writeback 結束，它才不會把舊資料寫回去
+    if (tail != tail_end) {
+        truncate_pagecache_range(inode, tail, tail_end - 1);
+        ret = osfs_zero_block_range(inode, tail, tail_end - tail);
+        if (ret)
+            return ret;
+    }
+
+    truncate_setsize(inode, new_size);
+    osfs_inode->i_size = new_size;
+    osfs_image_dirty_inode(sb_info, inode->i_ino);
+    if (new_size >= old_size || first_free > U32_MAX)
+        return 0;
+
+    // EOF 之後的 block 全部釋放，包括 FALLOC_FL_KEEP_SIZE 預先分配的部分
+    osfs_meta_begin(sb_info);
+    down_write(&osfs_inode->i_extent_sem);
+    ret = osfs_extent_remove(sb_info, osfs_inode, first_free, (1ULL << 32) - first_free);
+    osfs_set_i_blocks(inode, osfs_inode);
+    up_write(&osfs_inode->i_extent_sem);
+    osfs_meta_end(sb_info);
+    return ret;
+}
+
+/**
+ * Function: osfs_setattr
+ * Description: Changes the attributes of a regular file, including its size
+ *              for truncate and O_TRUNC.
+ * Inputs:
+ *   - idmap: The idmap of the mount.
+ *   - dentry: The dentry of the file.
+ *   - attr: The attributes to change.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry, struct iattr *attr)
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = setattr_prepare(idmap, dentry, attr);
+    if (ret)
+        return ret;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        // 擋住 page fault，避免 mmap 在截斷途中又把 page 讀回來或弄髒
+        filemap_invalidate_lock(inode->i_mapping);
+        ret = osfs_setsize(inode, attr->ia_size);
+        filemap_invalidate_unlock(inode->i_mapping);
+        if (ret)
+            return ret;
+    }
+
+    setattr_copy(idmap, inode, attr);
+    // osfs_dirty_inode 把新的屬性複製到 inode table
+    mark_inode_dirty(inode);
+    return 0;
+}
+
 /**
  * Struct: osfs_file_inode_operations
  * Description: Defines the inode operations for regular files in osfs.
- * Note: Add additional operations such as getattr as needed.
  */
 const struct inode_operations osfs_file_inode_operations = {
-    // Add inode operations here, e.g., .getattr = osfs_getattr,
+    .setattr = osfs_setattr,
 };
@@ -0,0 +1,1551 @@
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/crc32c.h>
+#include <linux/xxhash.h>
+#include <linux/log2.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include "osfs.h"
+
+/*
+ * Backing image of a mount (mount option image=). The format is described in
+ * osfs.h. Everything the filesystem keeps in RAM is written out by a checkpoint
+ * on sync_fs, which also runs at unmount, and every ckpt_interval= seconds;
+ * the next mount of the same file reads it back.
+ *
+ * A block device mounted directly holds the same format from offset 0 and is
+ * accessed with bios. There only directory blocks are kept in the data pool;
+ * regular file data is read and written by the page cache in place, in the
+ * data area, and a checkpoint saves the metadata that maps it. A block
+ * allocated for it is saved as unwritten until a journal commit or checkpoint
+ * has written its data back, so a crash never exposes what the device held
+ * there before.
+ *
+ * Checkpoints are incremental. Data blocks are marked dirty when they are
+ * modified and only those are written, in block order and in runs of up to
+ * OSFS_IMAGE_BATCH blocks. Metadata is rebuilt in memory chunk by chunk and
+ * compared with a hash of what the target slot already holds, so only the
+ * chunks that changed are written, again in runs of adjacent chunks. The
+ * extent records are a packed stream, so a change to one inode's extents
+ * rewrites the chunks from there to the end of the stream; they are small
+ * next to the data they describe.
+ *
+ * Between checkpoints, changes reach the image through the journal of the
+ * last checkpoint's slot (journal.c). A checkpoint empties it: directory
+ * blocks changed since the previous checkpoint go into the target slot's
+ * journal first, are written in place once the commit record is on disk, and
+ * the journal starts over behind them.
+ */
+
+#define OSFS_IMAGE_BUF_SIZE (1 << 20) // Staging buffer for metadata runs and loads
+
+/**
+ * Struct: osfs_image_run
+ * Description: Adjacent metadata chunks waiting to be written with one call.
+ */
+struct osfs_image_run {
+    void *buf;                   // OSFS_IMAGE_BUF_SIZE bytes
+    uint64_t pos;                // Slot offset of the first chunk
+    size_t len;                  // Bytes of chunks in buf
+};
+
+/**
+ * Struct: osfs_image_writer
+ * Description: State of a checkpoint in progress.
+ */
+struct osfs_image_writer {
+    struct osfs_sb_info *sb_info;
+    struct osfs_image *image;
+    struct osfs_image_slot *slot;      // Slot being written
+    struct osfs_image_slot *committed; // Slot of the last checkpoint
+    struct osfs_image_run itable_run;  // Inode table, then the bitmaps
+    struct osfs_image_run extent_run;  // Extent records
+    void *chunk;                 // Inode table chunk being filled
+    void *ext_chunk;             // Extent record chunk being filled
+    size_t ext_used;             // Bytes used in ext_chunk
+    uint64_t ext_pos;            // Bytes of extent records in completed chunks
+    struct kvec *vec;            // OSFS_IMAGE_BATCH entries for data blocks
+    unsigned long *bmap;         // Blocks referenced by the saved extents
+    unsigned long *imap;         // Inodes saved
+    bool changed;                // The metadata differs from the last checkpoint
+    bool data_written;           // Some data block was written
+};
+
+/**
+ * Function: osfs_image_bdev_io
+ * Description: Reads or writes a list of kernel buffers at a byte offset of
+ *              the block device, as a chain of bios that is waited on as one.
+ *              The offset and the buffer lengths are multiples of the logical
+ *              block size.
+ * Inputs:
+ *   - bdev: The block device.
+ *   - vec: The buffers, from kmalloc, a slab cache or vmalloc.
+ *   - nr_vec: The number of buffers.
+ *   - len: The total length of the buffers.
+ *   - pos: The device offset.
+ *   - write: Write the buffers to the device instead of reading them.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the device on failure.
+ */
+static int osfs_image_bdev_io(struct block_device *bdev, struct kvec *vec, unsigned int nr_vec,
+                              size_t len, loff_t pos, bool write)
+{
+    blk_opf_t opf = write ? REQ_OP_WRITE | REQ_SYNC : REQ_OP_READ;
+    unsigned int nr_pages = min_t(size_t, DIV_ROUND_UP(len, PAGE_SIZE) + nr_vec, BIO_MAX_VECS);
+    struct bio *bio, *prev;
+    struct page *page;
+    unsigned int i;
+    size_t left, n;
+    void *addr;
+    int ret;
+
+    bio = bio_alloc(bdev, nr_pages, opf, GFP_NOIO);
+    bio->bi_iter.bi_sector = pos >> SECTOR_SHIFT;
+    for (i = 0; i < nr_vec; i++) {
+        addr = vec[i].iov_base;
+        left = vec[i].iov_len;
+        if (write && is_vmalloc_addr(addr))
+            flush_kernel_vmap_range(addr, left);
+        while (left) {
+            n = min_t(size_t, left, PAGE_SIZE - offset_in_page(addr));
+            page = is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+            // bio 滿了就接一個新的，前一個先送出去，最後一起等
+            while (bio_add_page(bio, page, n, offset_in_page(addr)) != n) {
+                prev = bio;
+                bio = bio_alloc(bdev, nr_pages, opf, GFP_NOIO);
+                bio->bi_iter.bi_sector = bio_end_sector(prev);
+                bio_chain(prev, bio);
+                submit_bio(prev);
+            }
+            addr += n;
+            left -= n;
+        }
+    }
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+
+    if (!write) {
+        for (i = 0; i < nr_vec; i++) {
+            if (is_vmalloc_addr(vec[i].iov_base))
+                invalidate_kernel_vmap_range(vec[i].iov_base, vec[i].iov_len);
+        }
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_image_io
+ * Description: Reads or writes a list of kernel buffers at an image offset,
+ *              through the backing file or the block device.
+ * Inputs:
+ *   - image: The image.
+ *   - vec: The buffers.
+ *   - nr_vec: The number of buffers.
+ *   - len: The total length of the buffers.
+ *   - pos: The image offset.
+ *   - write: Write the buffers to the image instead of reading them.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the file ends before everything is read.
+ *   - A negative error code from the file or device on failure.
+ */
+static int osfs_image_io(struct osfs_image *image, struct kvec *vec, unsigned int nr_vec,
+                         size_t len, loff_t pos, bool write)
+{
+    struct iov_iter iter;
+    ssize_t ret;
+
+    if (image->bdev)
+        return osfs_image_bdev_io(image->bdev, vec, nr_vec, len, pos, write);
+
+    iov_iter_kvec(&iter, write ? ITER_SOURCE : ITER_DEST, vec, nr_vec, len);
+    while (iov_iter_count(&iter)) {
+        if (write)
+            ret = vfs_iter_write(image->file, &iter, &pos, 0);
+        else
+            ret = vfs_iter_read(image->file, &iter, &pos, 0);
+        if (ret < 0)
+            return ret;
+        // 讀到檔案結尾還不夠，image 被截斷了
+        if (ret == 0)
+            return -EIO;
+    }
+    return 0;
+}
+
+int osfs_image_rw(struct osfs_image *image, void *buf, size_t len, loff_t pos, bool write)
+{
+    struct kvec vec = { .iov_base = buf, .iov_len = len };
+
+    return osfs_image_io(image, &vec, 1, len, pos, write);
+}
+
+// Makes everything written so far durable
+int osfs_image_flush(struct osfs_image *image)
+{
+    if (image->bdev)
+        return blkdev_issue_flush(image->bdev);
+    return vfs_fsync(image->file, 0);
+}
+
+// Region sizes of a metadata slot, each rounded up to OSFS_IMAGE_ALIGN
+static uint64_t osfs_image_bmap_len(uint32_t nbits)
+{
+    return ALIGN(BITS_TO_U64(nbits) * sizeof(u64), OSFS_IMAGE_ALIGN);
+}
+
+static uint64_t osfs_image_itable_len(struct osfs_sb_info *sb_info)
+{
+    return ALIGN((uint64_t)sb_info->inode_count * sizeof(struct osfs_disk_inode), OSFS_IMAGE_ALIGN);
+}
+
+/**
+ * Function: osfs_image_layout
+ * Description: Computes where each region of the image lives from the
+ *              geometry in sb_info. Every region has room for a full
+ *              filesystem, so the layout never changes between checkpoints.
+ *              The journals grow with the data area, within OSFS_JOURNAL_MIN
+ *              and OSFS_JOURNAL_MAX.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - image: Where to store the offsets.
+ * Returns:
+ *   - None.
+ */
+static void osfs_image_layout(struct osfs_sb_info *sb_info, struct osfs_image *image)
+{
+    // 兩個 superblock 共用第一個 OSFS_IMAGE_ALIGN
+    uint64_t off = OSFS_IMAGE_ALIGN;
+    struct osfs_image_slot *slot;
+    int i;
+
+    // 每個 inode 一個 head；extent 不會共用 block，所以總數不超過 block 數
+    image->extent_max = (uint64_t)sb_info->inode_count * sizeof(struct osfs_disk_extent_head) +
+                        (uint64_t)sb_info->block_count * sizeof(struct osfs_disk_extent);
+    image->meta_len = osfs_image_bmap_len(sb_info->block_count) +
+                      osfs_image_bmap_len(sb_info->inode_count) +
+                      osfs_image_itable_len(sb_info) + ALIGN(image->extent_max, OSFS_IMAGE_ALIGN);
+
+    for (i = 0; i < 2; i++) {
+        slot = &image->slots[i];
+        slot->bmap_off = off;
+        slot->imap_off = slot->bmap_off + osfs_image_bmap_len(sb_info->block_count);
+        slot->itable_off = slot->imap_off + osfs_image_bmap_len(sb_info->inode_count);
+        slot->extent_off = slot->itable_off + osfs_image_itable_len(sb_info);
+        off += image->meta_len;
+    }
+    image->journal_len = clamp_t(uint64_t,
+                                 ALIGN(((uint64_t)sb_info->block_count * sb_info->block_size) >> 5,
+                                       OSFS_IMAGE_ALIGN),
+                                 OSFS_JOURNAL_MIN, OSFS_JOURNAL_MAX);
+    for (i = 0; i < 2; i++) {
+        image->slots[i].journal_off = off;
+        off += image->journal_len;
+    }
+    image->data_off = ALIGN(off, max_t(uint64_t, OSFS_IMAGE_ALIGN, sb_info->block_size));
+}
+
+/**
+ * Function: osfs_image_alloc_state
+ * Description: Allocates the chunk hashes of both slots, the dirty block
+ *              and inode bitmaps and the journal buffer once the geometry is
+ *              known.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_image_alloc_state(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    size_t nr_chunks = image->meta_len / OSFS_IMAGE_ALIGN;
+    int i;
+
+    osfs_image_layout(sb_info, image);
+    for (i = 0; i < 2; i++) {
+        image->slots[i].chunk_hash = kvcalloc(nr_chunks, sizeof(u64), GFP_KERNEL);
+        if (!image->slots[i].chunk_hash)
+            return -ENOMEM;
+    }
+    image->dirty = kvcalloc(BITS_TO_LONGS(sb_info->block_count), sizeof(unsigned long),
+                            GFP_KERNEL);
+    image->log_blocks = kvcalloc(BITS_TO_LONGS(sb_info->block_count), sizeof(unsigned long),
+                                 GFP_KERNEL);
+    image->home_blocks = kvcalloc(BITS_TO_LONGS(sb_info->block_count), sizeof(unsigned long),
+                                  GFP_KERNEL);
+    image->freed_blocks = kvcalloc(BITS_TO_LONGS(sb_info->block_count), sizeof(unsigned long),
+                                   GFP_KERNEL);
+    image->release_blocks = kvcalloc(BITS_TO_LONGS(sb_info->block_count), sizeof(unsigned long),
+                                     GFP_KERNEL);
+    image->dirty_inodes = kvcalloc(BITS_TO_LONGS(sb_info->inode_count), sizeof(unsigned long),
+                                   GFP_KERNEL);
+    image->freed_inodes = kvcalloc(BITS_TO_LONGS(sb_info->inode_count), sizeof(unsigned long),
+                                   GFP_KERNEL);
+    image->release_inodes = kvcalloc(BITS_TO_LONGS(sb_info->inode_count), sizeof(unsigned long),
+                                     GFP_KERNEL);
+    image->ordered_inodes = kvcalloc(BITS_TO_LONGS(sb_info->inode_count), sizeof(unsigned long),
+                                     GFP_KERNEL);
+    image->jbuf = kvmalloc(image->journal_len, GFP_KERNEL);
+    if (!image->dirty || !image->log_blocks || !image->home_blocks || !image->dirty_inodes ||
+        !image->ordered_inodes || !image->jbuf || !image->freed_blocks || !image->release_blocks ||
+        !image->freed_inodes || !image->release_inodes)
+        return -ENOMEM;
+    return 0;
+}
+
+static loff_t osfs_image_block_pos(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    return sb_info->image->data_off + (loff_t)block_no * sb_info->block_size;
+}
+
+// Hash of a metadata chunk; 0 is reserved for a chunk whose contents are unknown
+static u64 osfs_image_chunk_hash(const void *chunk)
+{
+    return xxh64(chunk, OSFS_IMAGE_ALIGN, 0) ?: 1;
+}
+
+// Records the hashes of chunks just read from a slot, starting at slot offset pos
+static void osfs_image_note_chunks(struct osfs_image_slot *slot, uint64_t pos,
+                                   const void *buf, size_t len)
+{
+    size_t off;
+
+    for (off = 0; off < len; off += OSFS_IMAGE_ALIGN)
+        slot->chunk_hash[(pos + off) / OSFS_IMAGE_ALIGN] = osfs_image_chunk_hash(buf + off);
+}
+
+static bool osfs_image_super_valid(const struct osfs_disk_super *ds)
+{
+    struct osfs_disk_super copy = *ds;
+
+    copy.s_checksum = 0;
+    return le32_to_cpu(ds->s_magic) == OSFS_IMAGE_MAGIC &&
+           le32_to_cpu(ds->s_version) == OSFS_IMAGE_VERSION &&
+           crc32c(~0, &copy, sizeof(copy)) == le32_to_cpu(ds->s_checksum);
+}
+
+static void osfs_image_ckpt_work(struct work_struct *work);
+
+/**
+ * Function: osfs_image_fit_bdev
+ * Description: Sizes the data area of a new filesystem on a block device so
+ *              that it runs to the end of the device, or holds
+ *              OSFS_IMAGE_MAX_BLOCKS blocks on a larger one. The metadata
+ *              slots grow with the number of blocks, so the count is lowered
+ *              until the whole layout fits.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the device cannot hold two data blocks.
+ */
+static int osfs_image_fit_bdev(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    uint64_t dev_size = bdev_nr_bytes(image->bdev);
+    uint64_t count = min_t(uint64_t, div_u64(dev_size, sb_info->block_size),
+                           OSFS_IMAGE_MAX_BLOCKS);
+    uint64_t end, over;
+
+    for (;;) {
+        sb_info->block_count = count;
+        osfs_image_layout(sb_info, image);
+        end = image->data_off + count * sb_info->block_size;
+        if (end <= dev_size)
+            return 0;
+        over = DIV_ROUND_UP_ULL(end - dev_size, sb_info->block_size);
+        if (count < over + 2) {
+            pr_err("osfs_image_fit_bdev: %pg is too small\n", image->bdev);
+            return -EINVAL;
+        }
+        count -= over;
+    }
+}
+
+/**
+ * Function: osfs_image_open
+ * Description: Opens the image of a mount: the backing file named by image=,
+ *              created if needed, or in block-device mode the mounted device.
+ *              An existing image is validated and its geometry replaces the
+ *              one from the mount options. An empty file, or a device mounted
+ *              with format, starts a new image with the geometry in sb_info;
+ *              on a device the data area is sized to the device instead of
+ *              size=. Called by osfs_fill_super before anything is sized.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - path: The path of the backing file, or of the device for messages.
+ *   - format: Whether to start a new image on the device even if it holds one.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the file or device is not a usable osfs image.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from opening or reading the image on failure.
+ */
+int osfs_image_open(struct osfs_sb_info *sb_info, const char *path, bool format)
+{
+    struct osfs_disk_super *ds = NULL;
+    struct osfs_image_slot *slot;
+    struct osfs_image *image;
+    struct file *file;
+    uint32_t block_size, inode_count, block_count;
+    int ret, i;
+
+    image = kzalloc(sizeof(*image), GFP_KERNEL);
+    if (!image)
+        return -ENOMEM;
+    image->sb_info = sb_info;
+    INIT_DELAYED_WORK(&image->ckpt_work, osfs_image_ckpt_work);
+    INIT_DELAYED_WORK(&image->commit_work, osfs_journal_commit_work);
+    mutex_init(&image->commit_mutex);
+    // 還沒有任何 commit，第一個 commit 是 1
+    image->running_tid = 1;
+    // 失敗時由 osfs_free_sb_info 經 osfs_image_close 釋放
+    sb_info->image = image;
+
+    image->supers = kzalloc(OSFS_IMAGE_ALIGN, GFP_KERNEL);
+    if (!image->supers)
+        return -ENOMEM;
+
+    if (sb_info->bdev) {
+        image->bdev = sb_info->bdev;
+        // 只有明確要求 format 才會在裝置上建新的 image
+        if (format)
+            goto new_image;
+    } else {
+        file = filp_open(path, O_RDWR | O_LARGEFILE | O_CREAT, 0600);
+        if (IS_ERR(file)) {
+            pr_err("osfs_image_open: Cannot open %s: %ld\n", path, PTR_ERR(file));
+            return PTR_ERR(file);
+        }
+        image->file = file;
+
+        // image 放在 osfs 自己上面的話，checkpoint 會寫進正在 checkpoint 的檔案系統
+        if (!S_ISREG(file_inode(file)->i_mode) || file_inode(file)->i_sb->s_magic == OSFS_MAGIC) {
+            pr_err("osfs_image_open: %s must be a regular file outside osfs\n", path);
+            return -EINVAL;
+        }
+        // 空檔案就是新的 image
+        if (i_size_read(file_inode(file)) == 0)
+            goto new_image;
+    }
+
+    ret = osfs_image_rw(image, image->supers, OSFS_IMAGE_ALIGN, 0, false);
+    if (ret)
+        return ret;
+
+    // 兩個 commit record 裡取有效且 generation 較新的那個
+    for (i = 0; i < 2; i++) {
+        struct osfs_disk_super *cand = image->supers + i * OSFS_IMAGE_SUPER_STRIDE;
+
+        if (osfs_image_super_valid(cand) &&
+            (!ds || le64_to_cpu(cand->s_generation) > le64_to_cpu(ds->s_generation))) {
+            ds = cand;
+            image->slot = i;
+        }
+    }
+    if (!ds) {
+        pr_err("osfs_image_open: %s is not an osfs image%s\n", path,
+               image->bdev ? ", mount with format to create one" : "");
+        return -EINVAL;
+    }
+
+    block_size = le32_to_cpu(ds->s_block_size);
+    inode_count = le32_to_cpu(ds->s_inode_count);
+    block_count = le32_to_cpu(ds->s_block_count);
+    if (!is_power_of_2(block_size) || block_size < OSFS_MIN_BLOCK_SIZE ||
+        block_size > PAGE_SIZE || inode_count <= ROOT_INODE + 1 ||
+        inode_count > OSFS_IMAGE_MAX_INODES || block_count < 2 ||
+        block_count > OSFS_IMAGE_MAX_BLOCKS ||
+        (image->bdev && block_size < bdev_logical_block_size(image->bdev))) {
+        pr_err("osfs_image_open: %s has a bad geometry\n", path);
+        return -EINVAL;
+    }
+    // 大小以 image 為準，掛載選項的 size、nr_inodes、bsize 不再生效
+    sb_info->block_size = block_size;
+    sb_info->inode_count = inode_count;
+    sb_info->block_count = block_count;
+
+    // 先檢查 layout 再配置記憶體，壞掉的 image 不會讓掛載配置一大堆 bitmap
+    osfs_image_layout(sb_info, image);
+    slot = &image->slots[image->slot];
+    if (le64_to_cpu(ds->s_bmap_off) != slot->bmap_off ||
+        le64_to_cpu(ds->s_imap_off) != slot->imap_off ||
+        le64_to_cpu(ds->s_itable_off) != slot->itable_off ||
+        le64_to_cpu(ds->s_extent_off) != slot->extent_off ||
+        le64_to_cpu(ds->s_data_off) != image->data_off ||
+        le64_to_cpu(ds->s_extent_len) > image->extent_max ||
+        le64_to_cpu(ds->s_journal_off) != slot->journal_off ||
+        le64_to_cpu(ds->s_journal_len) != image->journal_len ||
+        (image->bdev && image->data_off + (uint64_t)block_count * block_size >
+                        bdev_nr_bytes(image->bdev))) {
+        pr_err("osfs_image_open: %s has an unexpected layout\n", path);
+        return -EINVAL;
+    }
+    // 載入時會讀 commit 的 slot 裡所有的 metadata，檔案比它短就不是完整的 image
+    if (image->file && i_size_read(file_inode(image->file)) <
+                       slot->extent_off + le64_to_cpu(ds->s_extent_len)) {
+        pr_err("osfs_image_open: %s is shorter than its metadata\n", path);
+        return -EINVAL;
+    }
+    ret = osfs_image_alloc_state(sb_info);
+    if (ret)
+        return ret;
+
+    image->generation = le64_to_cpu(ds->s_generation);
+    image->extent_len = le64_to_cpu(ds->s_extent_len);
+    image->loaded = true;
+    return 0;
+
+new_image:
+    // 新的 image 大小照掛載選項；第一次 checkpoint 寫進 slot 0，
+    // 並把兩個 commit record 一起寫掉，裝置上舊的 image 就不再有效
+    memset(image->supers, 0, OSFS_IMAGE_ALIGN);
+    image->slot = 1;
+    if (sb_info->inode_count > OSFS_IMAGE_MAX_INODES ||
+        (!image->bdev && sb_info->block_count > OSFS_IMAGE_MAX_BLOCKS)) {
+        pr_err("osfs_image_open: An image holds at most %u inodes and %u blocks\n",
+               OSFS_IMAGE_MAX_INODES, OSFS_IMAGE_MAX_BLOCKS);
+        return -EINVAL;
+    }
+    if (image->bdev) {
+        if (sb_info->block_size < bdev_logical_block_size(image->bdev)) {
+            pr_err("osfs_image_open: bsize is below the sector size of %s\n", path);
+            return -EINVAL;
+        }
+        ret = osfs_image_fit_bdev(sb_info);
+        if (ret)
+            return ret;
+    }
+    return osfs_image_alloc_state(sb_info);
+}
+
+/**
+ * Function: osfs_image_close
+ * Description: Closes the image of a mount, if it has one.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_image_close(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+
+    if (!image)
+        return;
+    osfs_image_stop(sb_info);
+    // 裝置由 VFS 在 kill_block_super 時釋放
+    if (image->file)
+        fput(image->file);
+    kvfree(image->jbuf);
+    kvfree(image->release_inodes);
+    kvfree(image->freed_inodes);
+    kvfree(image->release_blocks);
+    kvfree(image->freed_blocks);
+    kvfree(image->ordered_inodes);
+    kvfree(image->dirty_inodes);
+    kvfree(image->home_blocks);
+    kvfree(image->log_blocks);
+    kvfree(image->dirty);
+    kvfree(image->slots[0].chunk_hash);
+    kvfree(image->slots[1].chunk_hash);
+    kfree(image->supers);
+    kfree(image);
+    sb_info->image = NULL;
+}
+
+// Reads one of the bitmaps of the loaded slot into its allocator
+static int osfs_image_load_bitmap(struct osfs_image *image, struct osfs_allocator *alloc,
+                                  uint64_t off)
+{
+    struct osfs_image_slot *slot = &image->slots[image->slot];
+    size_t len = osfs_image_bmap_len(alloc->size);
+    size_t nr = BITS_TO_U64(alloc->size);
+    u64 *words;
+    size_t i;
+    int ret;
+
+    words = kvmalloc(len, GFP_KERNEL);
+    if (!words)
+        return -ENOMEM;
+    ret = osfs_image_rw(image, words, len, off, false);
+    if (!ret) {
+        osfs_image_note_chunks(slot, off - slot->bmap_off, words, len);
+        for (i = 0; i < nr; i++)
+            words[i] = le64_to_cpu((__force __le64)words[i]);
+        osfs_allocator_load(alloc, words);
+    }
+    kvfree(words);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_pack_inode
+ * Description: Fills an inode table record from an inode, except for
+ *              i_nr_extents, which the caller reads with the extents.
+ * Inputs:
+ *   - osfs_inode: The inode table entry.
+ *   - rec: The record to fill.
+ * Returns:
+ *   - None.
+ */
+void osfs_image_pack_inode(const struct osfs_inode *osfs_inode, struct osfs_disk_inode *rec)
+{
+    rec->i_mode = cpu_to_le16(osfs_inode->i_mode);
+    rec->i_links_count = cpu_to_le16(osfs_inode->i_links_count);
+    rec->i_uid = cpu_to_le32(osfs_inode->i_uid);
+    rec->i_gid = cpu_to_le32(osfs_inode->i_gid);
+    rec->i_size = cpu_to_le64(osfs_inode->i_size);
+    rec->i_atime = cpu_to_le64(osfs_inode->__i_atime.tv_sec);
+    rec->i_atime_nsec = cpu_to_le32(osfs_inode->__i_atime.tv_nsec);
+    rec->i_mtime = cpu_to_le64(osfs_inode->__i_mtime.tv_sec);
+    rec->i_mtime_nsec = cpu_to_le32(osfs_inode->__i_mtime.tv_nsec);
+    rec->i_ctime = cpu_to_le64(osfs_inode->__i_ctime.tv_sec);
+    rec->i_ctime_nsec = cpu_to_le32(osfs_inode->__i_ctime.tv_nsec);
+}
+
+/**
+ * Function: osfs_image_unpack_inode
+ * Description: Sets the attributes of a reset inode table entry from a
+ *              record. The extent map is restored separately.
+ * Inputs:
+ *   - osfs_inode: The inode table entry, reset by osfs_init_osfs_inode.
+ *   - rec: The record.
+ * Returns:
+ *   - None.
+ */
+void osfs_image_unpack_inode(struct osfs_inode *osfs_inode, const struct osfs_disk_inode *rec)
+{
+    osfs_inode->i_mode = le16_to_cpu(rec->i_mode);
+    osfs_inode->i_links_count = le16_to_cpu(rec->i_links_count);
+    osfs_inode->i_uid = le32_to_cpu(rec->i_uid);
+    osfs_inode->i_gid = le32_to_cpu(rec->i_gid);
+    osfs_inode->i_size = le64_to_cpu(rec->i_size);
+    osfs_inode->__i_atime.tv_sec = le64_to_cpu(rec->i_atime);
+    osfs_inode->__i_atime.tv_nsec = le32_to_cpu(rec->i_atime_nsec);
+    osfs_inode->__i_mtime.tv_sec = le64_to_cpu(rec->i_mtime);
+    osfs_inode->__i_mtime.tv_nsec = le32_to_cpu(rec->i_mtime_nsec);
+    osfs_inode->__i_ctime.tv_sec = le64_to_cpu(rec->i_ctime);
+    osfs_inode->__i_ctime.tv_nsec = le32_to_cpu(rec->i_ctime_nsec);
+    // i_nr_extents 和 i_blocks 由 extent 載入時累加
+}
+
+/**
+ * Function: osfs_image_load_inodes
+ * Description: Reads the inode table of the loaded slot into the in-memory table.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - buf: A staging buffer of OSFS_IMAGE_BUF_SIZE bytes.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if a record disagrees with the inode bitmap.
+ *   - A negative error code from reading the file on failure.
+ */
+static int osfs_image_load_inodes(struct osfs_sb_info *sb_info, void *buf)
+{
+    struct osfs_image *image = sb_info->image;
+    struct osfs_image_slot *slot = &image->slots[image->slot];
+    struct osfs_inode *table = sb_info->inode_table;
+    uint64_t itable_len = osfs_image_itable_len(sb_info);
+    struct osfs_disk_inode *rec;
+    struct osfs_inode *osfs_inode;
+    uint64_t done;
+    uint32_t ino, i;
+    size_t len;
+    int ret;
+
+    for (done = 0; done < itable_len; done += len) {
+        len = min_t(uint64_t, OSFS_IMAGE_BUF_SIZE, itable_len - done);
+        ret = osfs_image_rw(image, buf, len, slot->itable_off + done, false);
+        if (ret)
+            return ret;
+        osfs_image_note_chunks(slot, slot->itable_off - slot->bmap_off + done, buf, len);
+
+        ino = done / sizeof(*rec);
+        for (i = 0; i < len / sizeof(*rec) && ino + i < sb_info->inode_count; i++) {
+            rec = (struct osfs_disk_inode *)buf + i;
+            if (!rec->i_mode)
+                continue;
+            if (ino + i < ROOT_INODE || !test_bit(ino + i, sb_info->inode_alloc.bitmap))
+                return -EUCLEAN;
+
+            osfs_inode = &table[ino + i];
+            osfs_init_osfs_inode(osfs_inode, ino + i);
+            osfs_image_unpack_inode(osfs_inode, rec);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_image_load_blocks
+ * Description: Gives the blocks of a restored extent their memory and reads
+ *              their contents from the data area. Unwritten blocks read as
+ *              zeros whatever their memory holds, so they are not read.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ext: The extent.
+ *   - vec: OSFS_IMAGE_BATCH entries of scratch space.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if block memory cannot be allocated.
+ *   - A negative error code from reading the file on failure.
+ */
+static int osfs_image_load_blocks(struct osfs_sb_info *sb_info, const struct osfs_extent *ext,
+                                  struct kvec *vec)
+{
+    uint32_t done, nr, i;
+    void *block;
+    int ret;
+
+    for (done = 0; done < ext->e_len; done += nr) {
+        nr = min_t(uint32_t, OSFS_IMAGE_BATCH, ext->e_len - done);
+        for (i = 0; i < nr; i++) {
+            block = osfs_populate_data_block(sb_info, ext->e_pblk + done + i, false);
+            if (!block)
+                return -ENOMEM;
+            vec[i].iov_base = block;
+            vec[i].iov_len = sb_info->block_size;
+        }
+        if (ext->e_flags & OSFS_EXTENT_UNWRITTEN)
+            continue;
+        ret = osfs_image_io(sb_info->image, vec, nr, (size_t)nr * sb_info->block_size,
+                            osfs_image_block_pos(sb_info, ext->e_pblk + done), false);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_image_restore_extents
+ * Description: Rebuilds the extent map of an inode from its extent records.
+ *              The extents must be valid and in logical block order; whether
+ *              they overlap other inodes' extents is checked once everything
+ *              is loaded.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The inode, with an empty extent map.
+ *   - dext: The extent records.
+ *   - nr: The number of records.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if a record is invalid.
+ *   - -ENOMEM if memory allocation fails.
+ */
+int osfs_image_restore_extents(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                               const struct osfs_disk_extent *dext, uint32_t nr)
+{
+    struct osfs_extent ext;
+    uint64_t next = 0;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < nr; i++) {
+        ext.e_lblk = le32_to_cpu(dext[i].e_lblk);
+        ext.e_pblk = le32_to_cpu(dext[i].e_pblk);
+        ext.e_len = le32_to_cpu(dext[i].e_len);
+        ext.e_flags = le32_to_cpu(dext[i].e_flags);
+        if (!ext.e_len || ext.e_lblk < next || (ext.e_flags & ~OSFS_EXTENT_UNWRITTEN) ||
+            (uint64_t)ext.e_lblk + ext.e_len > 1ULL << 32 ||
+            (uint64_t)ext.e_pblk + ext.e_len > sb_info->block_count)
+            return -EUCLEAN;
+        next = (uint64_t)ext.e_lblk + ext.e_len;
+
+        ret = osfs_extent_restore(osfs_inode, &ext);
+        if (ret)
+            return ret;
+        osfs_inode->i_blocks += ext.e_len;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_image_load_extents
+ * Description: Reads the extent records of the loaded slot and rebuilds the
+ *              extent map of every inode.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if the records are inconsistent.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from reading the file on failure.
+ */
+static int osfs_image_load_extents(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    struct osfs_image_slot *slot = &image->slots[image->slot];
+    struct osfs_inode *table = sb_info->inode_table;
+    uint64_t len = image->extent_len;
+    struct osfs_disk_extent_head *head;
+    uint64_t pos = 0;
+    uint32_t ino, nr;
+    void *buf;
+    int ret;
+
+    if (!len)
+        return 0;
+
+    // 讀到整個 chunk 為止，才能記下最後一個 chunk 的 hash
+    buf = kvmalloc(ALIGN(len, OSFS_IMAGE_ALIGN), GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    ret = osfs_image_rw(image, buf, ALIGN(len, OSFS_IMAGE_ALIGN), slot->extent_off, false);
+    if (ret)
+        goto out;
+    osfs_image_note_chunks(slot, slot->extent_off - slot->bmap_off, buf,
+                           ALIGN(len, OSFS_IMAGE_ALIGN));
+
+    while (pos < len) {
+        ret = -EUCLEAN;
+        if (len - pos < sizeof(*head))
+            goto out;
+        head = buf + pos;
+        pos += sizeof(*head);
+        ino = le32_to_cpu(head->h_ino);
+        nr = le32_to_cpu(head->h_nr_extents);
+        if (ino < ROOT_INODE || ino >= sb_info->inode_count || !table[ino].i_mode ||
+            table[ino].i_nr_extents || nr > (len - pos) / sizeof(struct osfs_disk_extent))
+            goto out;
+
+        ret = osfs_image_restore_extents(sb_info, &table[ino], buf + pos, nr);
+        if (ret)
+            goto out;
+        pos += (uint64_t)nr * sizeof(struct osfs_disk_extent);
+    }
+    ret = 0;
+out:
+    kvfree(buf);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_load_finish
+ * Description: Checks the restored extent maps against each other, gives
+ *              the allocators the inodes and blocks in use, and loads the
+ *              blocks kept in the data pool. The allocators are rebuilt from
+ *              the inode table because the journal replay may have changed it
+ *              since the slot's bitmaps were written.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - vec: OSFS_IMAGE_BATCH entries of scratch space.
+ *   - dir_blocks: Where to record the blocks that belong to directories.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if two inodes map the same block.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from reading the file on failure.
+ */
+static int osfs_image_load_finish(struct osfs_sb_info *sb_info, struct kvec *vec,
+                                  unsigned long *dir_blocks)
+{
+    struct osfs_inode *table = sb_info->inode_table;
+    struct osfs_inode *osfs_inode;
+    unsigned long *bmap, *imap;
+    struct osfs_extent ext;
+    uint64_t lblk;
+    uint32_t ino;
+    u64 *words;
+    int ret = -ENOMEM;
+
+    // 兩個 inode 指到同一個 block 的話，之後一個寫入會毀掉另一個
+    bmap = kvcalloc(BITS_TO_LONGS(sb_info->block_count), sizeof(unsigned long), GFP_KERNEL);
+    imap = kvcalloc(BITS_TO_LONGS(sb_info->inode_count), sizeof(unsigned long), GFP_KERNEL);
+    words = kvcalloc(BITS_TO_U64(max(sb_info->block_count, sb_info->inode_count)), sizeof(u64),
+                     GFP_KERNEL);
+    if (!bmap || !imap || !words)
+        goto out;
+
+    for (ino = ROOT_INODE; ino < sb_info->inode_count; ino++) {
+        osfs_inode = &table[ino];
+        if (!osfs_inode->i_mode)
+            continue;
+        __set_bit(ino, imap);
+        ret = 0;
+        down_read(&osfs_inode->i_extent_sem);
+        for (lblk = 0; !ret && lblk <= U32_MAX && osfs_extent_find(osfs_inode, lblk, &ext);
+             lblk = (uint64_t)ext.e_lblk + ext.e_len) {
+            if (find_next_bit(bmap, ext.e_pblk + ext.e_len, ext.e_pblk) < ext.e_pblk + ext.e_len) {
+                ret = -EUCLEAN;
+                break;
+            }
+            bitmap_set(bmap, ext.e_pblk, ext.e_len);
+            if (S_ISDIR(osfs_inode->i_mode))
+                bitmap_set(dir_blocks, ext.e_pblk, ext.e_len);
+            // 裝置模式下一般檔案的資料留在裝置上，由 page cache 讀取
+            if (osfs_in_pool(sb_info, osfs_inode))
+                ret = osfs_image_load_blocks(sb_info, &ext, vec);
+        }
+        up_read(&osfs_inode->i_extent_sem);
+        if (ret)
+            goto out;
+    }
+
+    bitmap_to_arr64(words, bmap, sb_info->block_count);
+    osfs_allocator_load(&sb_info->block_alloc, words);
+    bitmap_to_arr64(words, imap, sb_info->inode_count);
+    osfs_allocator_load(&sb_info->inode_alloc, words);
+    ret = 0;
+out:
+    kvfree(words);
+    kvfree(imap);
+    kvfree(bmap);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_load
+ * Description: Restores the filesystem from the slot chosen by
+ *              osfs_image_open: the bitmaps, the inode table and the extent
+ *              maps, then the transactions of the slot's journal, and last
+ *              the blocks kept in the data pool, with the directory blocks
+ *              the journal logged put on top. The hashes of the metadata read
+ *              are kept, so the first checkpoint back to this slot writes
+ *              only changes. Called by osfs_fill_super once the allocators,
+ *              inode table and data pool exist. Does nothing for a new image.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if the image is inconsistent.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from reading the file on failure.
+ */
+int osfs_image_load(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    unsigned long *dir_blocks = NULL;
+    struct osfs_image_slot *slot;
+    struct osfs_inode *root;
+    struct kvec *vec = NULL;
+    void *buf = NULL;
+    int ret;
+
+    if (!image || !image->loaded)
+        return 0;
+    slot = &image->slots[image->slot];
+
+    ret = osfs_image_load_bitmap(image, &sb_info->block_alloc, slot->bmap_off);
+    if (!ret)
+        ret = osfs_image_load_bitmap(image, &sb_info->inode_alloc, slot->imap_off);
+    if (ret)
+        goto out;
+
+    buf = kvmalloc(OSFS_IMAGE_BUF_SIZE, GFP_KERNEL);
+    vec = kmalloc_array(OSFS_IMAGE_BATCH, sizeof(*vec), GFP_KERNEL);
+    dir_blocks = kvcalloc(BITS_TO_LONGS(sb_info->block_count), sizeof(unsigned long), GFP_KERNEL);
+    if (!buf || !vec || !dir_blocks) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = osfs_image_load_inodes(sb_info, buf);
+    if (!ret)
+        ret = osfs_image_load_extents(sb_info);
+    if (!ret)
+        ret = osfs_journal_replay(sb_info);
+    if (!ret)
+        ret = osfs_image_load_finish(sb_info, vec, dir_blocks);
+    if (ret)
+        goto out;
+    // 目錄 block 以 journal 裡最新的內容為準
+    osfs_journal_apply_blocks(sb_info, dir_blocks);
+
+    root = &((struct osfs_inode *)sb_info->inode_table)[ROOT_INODE];
+    if (!S_ISDIR(root->i_mode))
+        ret = -EUCLEAN;
+out:
+    if (ret == -EUCLEAN)
+        pr_err("osfs_image_load: The image is corrupted\n");
+    kvfree(dir_blocks);
+    kfree(vec);
+    kvfree(buf);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_flush_run
+ * Description: Writes the chunks gathered in a run to the target slot. If the
+ *              write fails their contents on disk are unknown, so their hashes
+ *              are forgotten.
+ * Inputs:
+ *   - w: The checkpoint in progress.
+ *   - run: The run.
+ *   - write: Whether to write the run or only to drop it.
+ * Returns:
+ *   - 0 on success.
+ *   - -ECANCELED if the run was dropped.
+ *   - A negative error code from writing the file on failure.
+ */
+static int osfs_image_flush_run(struct osfs_image_writer *w, struct osfs_image_run *run, bool write)
+{
+    int ret = -ECANCELED;
+
+    if (!run->len)
+        return 0;
+    if (write)
+        ret = osfs_image_rw(w->image, run->buf, run->len, w->slot->bmap_off + run->pos, true);
+    if (ret)
+        memset(&w->slot->chunk_hash[run->pos / OSFS_IMAGE_ALIGN], 0,
+               run->len / OSFS_IMAGE_ALIGN * sizeof(u64));
+    run->len = 0;
+    return ret;
+}
+
+/**
+ * Function: osfs_image_put_chunk
+ * Description: Hands a rebuilt metadata chunk to the checkpoint. A chunk the
+ *              target slot already holds is skipped; others are added to the
+ *              run, which is written out when the next chunk does not follow
+ *              it or the run is full.
+ * Inputs:
+ *   - w: The checkpoint in progress.
+ *   - run: The run the chunk belongs to.
+ *   - pos: The slot offset of the chunk.
+ *   - chunk: OSFS_IMAGE_ALIGN bytes of metadata.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writing the file on failure.
+ */
+static int osfs_image_put_chunk(struct osfs_image_writer *w, struct osfs_image_run *run,
+                                uint64_t pos, const void *chunk)
+{
+    size_t idx = pos / OSFS_IMAGE_ALIGN;
+    u64 hash = osfs_image_chunk_hash(chunk);
+    int ret;
+
+    if (hash != w->committed->chunk_hash[idx])
+        w->changed = true;
+    if (hash == w->slot->chunk_hash[idx])
+        return 0;
+
+    if (run->len && (run->pos + run->len != pos || run->len == OSFS_IMAGE_BUF_SIZE)) {
+        ret = osfs_image_flush_run(w, run, true);
+        if (ret)
+            return ret;
+    }
+    if (!run->len)
+        run->pos = pos;
+    memcpy(run->buf + run->len, chunk, OSFS_IMAGE_ALIGN);
+    run->len += OSFS_IMAGE_ALIGN;
+    // 寫入失敗時 flush_run 會把 hash 清掉
+    w->slot->chunk_hash[idx] = hash;
+    return 0;
+}
+
+// Appends to the extent records, handing each full chunk to the checkpoint
+static int osfs_image_put_extent(struct osfs_image_writer *w, const void *rec, size_t len)
+{
+    uint64_t base = w->slot->extent_off - w->slot->bmap_off;
+    size_t n;
+    int ret;
+
+    while (len) {
+        // record 可能跨過 chunk 邊界
+        n = min(len, OSFS_IMAGE_ALIGN - w->ext_used);
+        memcpy(w->ext_chunk + w->ext_used, rec, n);
+        w->ext_used += n;
+        rec += n;
+        len -= n;
+        if (w->ext_used < OSFS_IMAGE_ALIGN)
+            break;
+        ret = osfs_image_put_chunk(w, &w->extent_run, base + w->ext_pos, w->ext_chunk);
+        if (ret)
+            return ret;
+        w->ext_pos += OSFS_IMAGE_ALIGN;
+        w->ext_used = 0;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_image_save_inode
+ * Description: Fills the inode table record of an inode and adds its extent
+ *              records. Inodes without links are saved as free: an unlinked
+ *              file that is still open goes away with the mount.
+ * Inputs:
+ *   - w: The checkpoint in progress.
+ *   - ino: The inode number.
+ *   - rec: The record to fill.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writing the file on failure.
+ */
+static int osfs_image_save_inode(struct osfs_image_writer *w, uint32_t ino,
+                                 struct osfs_disk_inode *rec)
+{
+    struct osfs_inode *osfs_inode = &((struct osfs_inode *)w->sb_info->inode_table)[ino];
+    struct osfs_disk_extent_head head;
+    struct osfs_disk_extent dext;
+    struct osfs_extent ext;
+    uint64_t lblk = 0;
+    int ret = 0;
+
+    memset(rec, 0, sizeof(*rec));
+    if (ino < ROOT_INODE || !osfs_inode->i_mode || !osfs_inode->i_links_count)
+        return 0;
+
+    down_read(&osfs_inode->i_extent_sem);
+    if (osfs_inode->i_nr_extents) {
+        head.h_ino = cpu_to_le32(ino);
+        head.h_nr_extents = cpu_to_le32(osfs_inode->i_nr_extents);
+        ret = osfs_image_put_extent(w, &head, sizeof(head));
+    }
+    while (!ret && lblk <= U32_MAX && osfs_extent_find(osfs_inode, lblk, &ext)) {
+        dext.e_lblk = cpu_to_le32(ext.e_lblk);
+        dext.e_pblk = cpu_to_le32(ext.e_pblk);
+        dext.e_len = cpu_to_le32(ext.e_len);
+        dext.e_flags = cpu_to_le32(osfs_extent_disk_flags(ext.e_flags));
+        ret = osfs_image_put_extent(w, &dext, sizeof(dext));
+        bitmap_set(w->bmap, ext.e_pblk, ext.e_len);
+        lblk = (uint64_t)ext.e_lblk + ext.e_len;
+    }
+    rec->i_nr_extents = cpu_to_le32(osfs_inode->i_nr_extents);
+    up_read(&osfs_inode->i_extent_sem);
+
+    osfs_image_pack_inode(osfs_inode, rec);
+    __set_bit(ino, w->imap);
+    return ret;
+}
+
+// Hands a bitmap to the checkpoint as little-endian 64-bit words
+static int osfs_image_save_bitmap(struct osfs_image_writer *w, const unsigned long *bits,
+                                  uint32_t nbits, uint64_t off)
+{
+    size_t len = osfs_image_bmap_len(nbits);
+    size_t nr = BITS_TO_U64(nbits);
+    uint64_t pos;
+    u64 *words;
+    size_t i;
+    int ret = 0;
+
+    words = kvzalloc(len, GFP_KERNEL);
+    if (!words)
+        return -ENOMEM;
+    bitmap_to_arr64(words, bits, nbits);
+    for (i = 0; i < nr; i++)
+        words[i] = (__force u64)cpu_to_le64(words[i]);
+    for (pos = 0; pos < len && !ret; pos += OSFS_IMAGE_ALIGN)
+        ret = osfs_image_put_chunk(w, &w->itable_run, off - w->slot->bmap_off + pos,
+                                   (void *)words + pos);
+    kvfree(words);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_save_data
+ * Description: Writes the file data blocks of the data pool modified since
+ *              they were last written, in block order, merging adjacent
+ *              blocks into one write. A block's dirty mark is cleared before
+ *              the block is read. Blocks whose write fails are marked again.
+ *              Called with ckpt_sem held for writing, so no block is freed
+ *              while it is written.
+ * Inputs:
+ *   - image: The image.
+ *   - vec: OSFS_IMAGE_BATCH entries of scratch space.
+ *   - written: Set to true if some block was written.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writing the file on failure.
+ */
+int osfs_image_save_data(struct osfs_image *image, struct kvec *vec, bool *written)
+{
+    struct osfs_sb_info *sb_info = image->sb_info;
+    unsigned long block, start = 0;
+    unsigned int nr = 0, i;
+    void *addr;
+    int ret = 0;
+
+    for_each_set_bit(block, image->dirty, sb_info->block_count) {
+        if (nr && (block != start + nr || nr == OSFS_IMAGE_BATCH)) {
+            ret = osfs_image_io(image, vec, nr, (size_t)nr * sb_info->block_size,
+                                osfs_image_block_pos(sb_info, start), true);
+            if (ret)
+                break;
+            nr = 0;
+        }
+        if (!test_and_clear_bit(block, image->dirty))
+            continue;
+        addr = osfs_block_addr(sb_info, block);
+        if (!addr)
+            continue;
+        if (!nr)
+            start = block;
+        vec[nr].iov_base = addr;
+        vec[nr].iov_len = sb_info->block_size;
+        nr++;
+        *written = true;
+    }
+    if (!ret && nr)
+        ret = osfs_image_io(image, vec, nr, (size_t)nr * sb_info->block_size,
+                            osfs_image_block_pos(sb_info, start), true);
+    if (ret) {
+        for (i = 0; i < nr; i++)
+            set_bit(start + i, image->dirty);
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_image_save_dirs
+ * Description: Writes the directory blocks logged since the last checkpoint
+ *              in place, merging adjacent blocks into one write. A block's
+ *              mark is cleared once it is written; blocks whose write fails
+ *              stay marked, so the next checkpoint logs them again.
+ * Inputs:
+ *   - w: The checkpoint in progress.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writing the file on failure.
+ */
+static int osfs_image_save_dirs(struct osfs_image_writer *w)
+{
+    struct osfs_sb_info *sb_info = w->sb_info;
+    struct osfs_image *image = w->image;
+    unsigned long block, start = 0;
+    unsigned int nr = 0;
+    void *addr;
+    int ret = 0;
+
+    for_each_set_bit(block, image->home_blocks, sb_info->block_count) {
+        if (nr && (block != start + nr || nr == OSFS_IMAGE_BATCH)) {
+            ret = osfs_image_io(image, w->vec, nr, (size_t)nr * sb_info->block_size,
+                                osfs_image_block_pos(sb_info, start), true);
+            if (ret)
+                return ret;
+            bitmap_clear(image->home_blocks, start, nr);
+            nr = 0;
+        }
+        addr = osfs_block_addr(sb_info, block);
+        if (!addr) {
+            clear_bit(block, image->home_blocks);
+            continue;
+        }
+        if (!nr)
+            start = block;
+        w->vec[nr].iov_base = addr;
+        w->vec[nr].iov_len = sb_info->block_size;
+        nr++;
+    }
+    if (nr) {
+        ret = osfs_image_io(image, w->vec, nr, (size_t)nr * sb_info->block_size,
+                            osfs_image_block_pos(sb_info, start), true);
+        if (!ret)
+            bitmap_clear(image->home_blocks, start, nr);
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_image_save_meta
+ * Description: Rebuilds the metadata of the filesystem chunk by chunk and
+ *              writes the chunks that differ from the target slot. The
+ *              bitmaps are derived from what was saved rather than copied
+ *              from the allocators, which also leaves out numbers parked in
+ *              the CPU magazines.
+ * Inputs:
+ *   - w: The checkpoint in progress.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from writing the file on failure.
+ */
+static int osfs_image_save_meta(struct osfs_image_writer *w)
+{
+    struct osfs_sb_info *sb_info = w->sb_info;
+    struct osfs_image_slot *slot = w->slot;
+    uint32_t per_chunk = OSFS_IMAGE_ALIGN / sizeof(struct osfs_disk_inode);
+    uint64_t itable_len = osfs_image_itable_len(sb_info);
+    uint64_t done;
+    uint32_t ino, i;
+    int ret = 0;
+
+    for (done = 0; done < itable_len && !ret; done += OSFS_IMAGE_ALIGN) {
+        ino = done / sizeof(struct osfs_disk_inode);
+        memset(w->chunk, 0, OSFS_IMAGE_ALIGN);
+        for (i = 0; i < per_chunk && ino + i < sb_info->inode_count && !ret; i++)
+            ret = osfs_image_save_inode(w, ino + i, (struct osfs_disk_inode *)w->chunk + i);
+        if (!ret)
+            ret = osfs_image_put_chunk(w, &w->itable_run,
+                                       slot->itable_off - slot->bmap_off + done, w->chunk);
+    }
+    // 最後一個 extent chunk 後面補 0
+    if (!ret && w->ext_used) {
+        memset(w->ext_chunk + w->ext_used, 0, OSFS_IMAGE_ALIGN - w->ext_used);
+        ret = osfs_image_put_chunk(w, &w->extent_run,
+                                   slot->extent_off - slot->bmap_off + w->ext_pos, w->ext_chunk);
+    }
+    if (!ret)
+        ret = osfs_image_flush_run(w, &w->extent_run, true);
+    if (!ret)
+        ret = osfs_image_flush_run(w, &w->itable_run, true);
+
+    if (!ret)
+        ret = osfs_image_save_bitmap(w, w->bmap, sb_info->block_count, slot->bmap_off);
+    if (!ret)
+        ret = osfs_image_save_bitmap(w, w->imap, sb_info->inode_count, slot->imap_off);
+    if (!ret)
+        ret = osfs_image_flush_run(w, &w->itable_run, true);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_commit
+ * Description: Writes the commit record of the target slot and flushes it.
+ *              The first OSFS_IMAGE_ALIGN bytes are written whole, with the
+ *              other slot's superblock as it already is on disk, so the write
+ *              is aligned for any sector size.
+ * Inputs:
+ *   - w: The checkpoint in progress.
+ *   - extent_len: The bytes of extent records written to the target slot.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the file or device on failure.
+ */
+static int osfs_image_commit(struct osfs_image_writer *w, uint64_t extent_len)
+{
+    struct osfs_sb_info *sb_info = w->sb_info;
+    struct osfs_image *image = w->image;
+    struct osfs_image_slot *slot = w->slot;
+    unsigned int target = slot - image->slots;
+    struct osfs_disk_super *ds = image->supers + target * OSFS_IMAGE_SUPER_STRIDE;
+    int ret;
+
+    // 寫入失敗的話這一格只是被下一次 commit 蓋掉，另一格照舊
+    memset(ds, 0, OSFS_IMAGE_SUPER_STRIDE);
+    ds->s_magic = cpu_to_le32(OSFS_IMAGE_MAGIC);
+    ds->s_version = cpu_to_le32(OSFS_IMAGE_VERSION);
+    ds->s_block_size = cpu_to_le32(sb_info->block_size);
+    ds->s_inode_count = cpu_to_le32(sb_info->inode_count);
+    ds->s_block_count = cpu_to_le32(sb_info->block_count);
+    ds->s_generation = cpu_to_le64(image->generation + 1);
+    ds->s_bmap_off = cpu_to_le64(slot->bmap_off);
+    ds->s_imap_off = cpu_to_le64(slot->imap_off);
+    ds->s_itable_off = cpu_to_le64(slot->itable_off);
+    ds->s_extent_off = cpu_to_le64(slot->extent_off);
+    ds->s_extent_len = cpu_to_le64(extent_len);
+    ds->s_data_off = cpu_to_le64(image->data_off);
+    ds->s_journal_off = cpu_to_le64(slot->journal_off);
+    ds->s_journal_len = cpu_to_le64(image->journal_len);
+    ds->s_checksum = cpu_to_le32(crc32c(~0, ds, sizeof(*ds)));
+
+    ret = osfs_image_rw(image, image->supers, OSFS_IMAGE_ALIGN, 0, true);
+    if (!ret)
+        ret = osfs_image_flush(image);
+    if (!ret) {
+        image->generation++;
+        image->slot = target;
+        image->extent_len = extent_len;
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_image_checkpoint
+ * Description: Writes a checkpoint of the filesystem to its image: the
+ *              directory blocks changed since the last checkpoint as the
+ *              first transaction of the target slot's journal, the modified
+ *              file data blocks of the data pool, the metadata chunks the
+ *              target slot lacks, a flush, and the target slot's commit
+ *              record; then the directory blocks in place. File data on a
+ *              block device is written back first by osfs_bdev_write_ordered;
+ *              blocks allocated after that are saved as unwritten.
+ *              If the directory blocks do not fit in the journal they are
+ *              written in place before the commit instead.
+ *              Namespace changes and block frees are held off for the
+ *              duration, and each inode's extent map while that inode is
+ *              saved, so the metadata is a consistent snapshot. Nothing is
+ *              committed when the metadata is unchanged and the journal
+ *              empty. Blocks and inodes freed before the checkpoint return to
+ *              the allocators only once it has committed, since until then
+ *              the committed slot may still map them. Called with
+ *              commit_mutex held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from writing the file on failure.
+ */
+int osfs_image_checkpoint(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    struct osfs_image_writer w = { .sb_info = sb_info, .image = image };
+    bool logged, committed = false;
+    uint64_t extent_len;
+    unsigned int nofs;
+    size_t jlen = 0;
+    u64 tid;
+    int ret = -ENOMEM;
+
+    lockdep_assert_held(&image->commit_mutex);
+
+    w.itable_run.buf = kvmalloc(OSFS_IMAGE_BUF_SIZE, GFP_KERNEL);
+    w.extent_run.buf = kvmalloc(OSFS_IMAGE_BUF_SIZE, GFP_KERNEL);
+    w.chunk = kmalloc(OSFS_IMAGE_ALIGN, GFP_KERNEL);
+    w.ext_chunk = kmalloc(OSFS_IMAGE_ALIGN, GFP_KERNEL);
+    w.vec = kmalloc_array(OSFS_IMAGE_BATCH, sizeof(*w.vec), GFP_KERNEL);
+    w.bmap = kvcalloc(BITS_TO_LONGS(sb_info->block_count), sizeof(unsigned long), GFP_KERNEL);
+    w.imap = kvcalloc(BITS_TO_LONGS(sb_info->inode_count), sizeof(unsigned long), GFP_KERNEL);
+    if (!w.itable_run.buf || !w.extent_run.buf || !w.chunk || !w.ext_chunk || !w.vec ||
+        !w.bmap || !w.imap)
+        goto out;
+
+    // 裝置上新分配的 block 先寫回資料，checkpoint 才能把它們存成 written
+    w.data_written = osfs_bdev_write_ordered(sb_info);
+    // 寫 image 時的記憶體回收不能再回頭寫 osfs
+    down_write(&sb_info->ckpt_sem);
+    nofs = memalloc_nofs_save();
+    w.committed = &image->slots[image->slot];
+    w.slot = &image->slots[image->slot ^ 1];
+
+    // 之後的修改歸下一個 commit；slot 會存下每個 inode，等著 journal 的標記都清掉
+    tid = image->running_tid;
+    WRITE_ONCE(image->running_tid, tid + 1);
+    bitmap_zero(image->dirty_inodes, sb_info->inode_count);
+    smp_mb();
+    // 到這裡為止釋放的 block 和 inode，要等這個 checkpoint commit 之後才能重用
+    osfs_journal_take_frees(sb_info);
+
+    logged = !osfs_journal_build(sb_info, true, &jlen);
+    ret = logged ? 0 : osfs_image_save_dirs(&w);
+    if (!ret)
+        ret = osfs_image_save_data(image, w.vec, &w.data_written);
+    if (!ret)
+        ret = osfs_image_save_meta(&w);
+    // 沒寫出去的 chunk，hash 不能算數
+    osfs_image_flush_run(&w, &w.extent_run, false);
+    osfs_image_flush_run(&w, &w.itable_run, false);
+
+    // journal 裡的 transaction 之後可能又被改回去，有 journal 就一定要 commit 才能清空它
+    extent_len = w.ext_pos + w.ext_used;
+    if (!ret && (w.changed || extent_len != image->extent_len || jlen || image->jhead)) {
+        if (jlen)
+            ret = osfs_journal_write(image, w.slot - image->slots, 0, jlen);
+        if (!ret)
+            ret = osfs_image_flush(image) ?: osfs_image_commit(&w, extent_len);
+        if (!ret) {
+            committed = true;
+            image->jhead = ALIGN(jlen, OSFS_IMAGE_ALIGN);
+            image->jseq = jlen ? 1 : 0;
+            // 寫回原位失敗的 block 還在新 journal 裡，也還留著標記
+            if (logged)
+                ret = osfs_image_save_dirs(&w);
+        }
+    } else if (!ret) {
+        if (w.data_written)
+            ret = osfs_image_flush(image);
+        committed = !ret;
+    }
+
+    if (committed)
+        image->committed_tid = tid;
+    else
+        osfs_journal_requeue(sb_info);
+    memalloc_nofs_restore(nofs);
+    up_write(&sb_info->ckpt_sem);
+    if (committed)
+        osfs_journal_release_frees(sb_info);
+    if (ret)
+        pr_err("osfs_image_checkpoint: Checkpoint failed: %d\n", ret);
+out:
+    kvfree(w.imap);
+    kvfree(w.bmap);
+    kfree(w.vec);
+    kfree(w.ext_chunk);
+    kfree(w.chunk);
+    kvfree(w.extent_run.buf);
+    kvfree(w.itable_run.buf);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_save
+ * Description: Writes a checkpoint of the filesystem to its image, after any
+ *              journal commit in progress.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success, or if the mount has no image.
+ *   - A negative error code from osfs_image_checkpoint on failure.
+ */
+int osfs_image_save(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    int ret;
+
+    if (!image || !image->active)
+        return 0;
+    mutex_lock(&image->commit_mutex);
+    ret = osfs_image_checkpoint(sb_info);
+    mutex_unlock(&image->commit_mutex);
+    return ret;
+}
+
+// Periodic checkpoint; re-arms itself until osfs_image_stop
+static void osfs_image_ckpt_work(struct work_struct *work)
+{
+    struct osfs_image *image = container_of(to_delayed_work(work), struct osfs_image, ckpt_work);
+
+    osfs_image_save(image->sb_info);
+    queue_delayed_work(system_long_wq, &image->ckpt_work, (unsigned long)image->interval * HZ);
+}
+
+/**
+ * Function: osfs_image_start
+ * Description: Allows checkpoints and journal commits once the mount has
+ *              succeeded, so that a failed mount never overwrites the image,
+ *              and starts the periodic ones. A new image gets its first
+ *              checkpoint right away, which the journal then follows. The
+ *              periodic checkpoint and commit save what writeback has put in
+ *              the data blocks; sync and fsync save everything.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - interval: Seconds between periodic checkpoints, 0 for none.
+ *   - commit_interval: Seconds between periodic journal commits, 0 for none.
+ * Returns:
+ *   - None.
+ */
+void osfs_image_start(struct osfs_sb_info *sb_info, unsigned int interval,
+                      unsigned int commit_interval)
+{
+    struct osfs_image *image = sb_info->image;
+
+    if (!image)
+        return;
+    image->active = true;
+    if (!image->loaded)
+        osfs_image_save(sb_info);
+    image->interval = interval;
+    if (interval)
+        queue_delayed_work(system_long_wq, &image->ckpt_work, (unsigned long)interval * HZ);
+    image->commit_interval = commit_interval;
+    if (commit_interval)
+        queue_delayed_work(system_long_wq, &image->commit_work,
+                           (unsigned long)commit_interval * HZ);
+}
+
+/**
+ * Function: osfs_image_stop
+ * Description: Stops the periodic checkpoint and journal commit and waits
+ *              for running ones.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_image_stop(struct osfs_sb_info *sb_info)
+{
+    if (!sb_info->image)
+        return;
+    cancel_delayed_work_sync(&sb_info->image->ckpt_work);
+    cancel_delayed_work_sync(&sb_info->image->commit_work);
+}
@@ -21,9 +21,25 @@ struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino)
     return &((struct osfs_inode *)(sb_info->inode_table))[ino];
 }
 
+/**
+ * Function: osfs_init_osfs_inode
+ * Description: Resets an inode table entry for a newly allocated inode.
+ * Inputs:
+ *   - osfs_inode: The inode table entry.
+ *   - ino: The inode number it now belongs to.
+ * Returns:
+ *   - None.
+ */
+void osfs_init_osfs_inode(struct osfs_inode *osfs_inode, uint32_t ino)
+{
+    memset(osfs_inode, 0, sizeof(*osfs_inode));
+    osfs_inode->i_ino = ino;
+    init_rwsem(&osfs_inode->i_extent_sem);
+}
+
 /**
  * Function: osfs_get_free_inode
- * Description: Allocates a free inode number from the inode bitmap.
+ * Description: Allocates a free inode number.
  * Inputs:
  *   - sb_info: The superblock information of the filesystem.
  * Returns:
@@ -34,20 +50,18 @@ int osfs_get_free_inode(struct osfs_sb_info *sb_info)
 {
     uint32_t ino;
 
-    for (ino = 1; ino < sb_info->inode_count; ino++) {
-        if (!test_bit(ino, sb_info->inode_bitmap)) {
-            set_bit(ino, sb_info->inode_bitmap);
-            sb_info->nr_free_inodes--;
-            return ino;
-        }
+    if (osfs_allocator_get(&sb_info->inode_alloc, &ino)) {
+        pr_err("osfs_get_free_inode: No free inode available\n");
+        return -ENOSPC;
     }
-    pr_err("osfs_get_free_inode: No free inode available\n");
-    return -ENOSPC;
+    return ino;
 }
 
 /**
  * Function: osfs_iget
- * Description: Creates or retrieves a VFS inode from a given inode number.
+ * Description: Retrieves the VFS inode of a given inode number. An inode
+ *              already in memory is found in the inode hash; otherwise a new
+ *              one is set up from the inode table.
  * Inputs:
  *   - sb: The superblock of the filesystem.
  *   - ino: The inode number to load.
@@ -65,13 +79,15 @@ struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
     if (!osfs_inode)
         return ERR_PTR(-EFAULT);
 
-    inode = new_inode(sb);
+    inode = iget_locked(sb, ino);
     if (!inode)
         return ERR_PTR(-ENOMEM);
+    // 已經在 inode cache 裡，直接用同一個 VFS inode
+    if (!(inode->i_state & I_NEW))
+        return inode;
 
-    inode->i_ino = ino;
-    inode->i_sb = sb;
     inode->i_mode = osfs_inode->i_mode;
+    set_nlink(inode, osfs_inode->i_links_count);
     i_uid_write(inode, osfs_inode->i_uid);
     i_gid_write(inode, osfs_inode->i_gid);
     // inode->__i_atime = osfs_inode->__i_atime;
@@ -81,8 +97,8 @@ struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
     inode_set_mtime_to_ts(inode, osfs_inode->__i_mtime);
     inode_set_ctime_to_ts(inode, osfs_inode->__i_ctime);
     inode->i_size = osfs_inode->i_size;
-    inode->i_blocks = osfs_inode->i_blocks;
-    inode->i_private = osfs_inode;
+    osfs_set_i_blocks(inode, osfs_inode);
+    OSFS_I(inode)->i_raw = osfs_inode;
 
     if (S_ISDIR(inode->i_mode)) {
         inode->i_op = &osfs_dir_inode_operations;
@@ -90,42 +106,179 @@ struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
     } else if (S_ISREG(inode->i_mode)) {
         inode->i_op = &osfs_file_inode_operations;
         inode->i_fop = &osfs_file_operations;
+        inode->i_mapping->a_ops = osfs_file_aops(sb);
     }
 
-    // Insert the inode into the inode hash
-    insert_inode_hash(inode);
-
+    unlock_new_inode(inode);
     return inode;
 }
 
+/**
+ * Function: osfs_release_inode
+ * Description: Gives the data blocks and the number of a deleted inode back to
+ *              the allocators once the deletion is committed. Called from
+ *              osfs_evict_inode once the last link and the last user are gone.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The inode table entry of the deleted inode.
+ * Returns:
+ *   - None.
+ */
+void osfs_release_inode(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode)
+{
+    osfs_meta_begin(sb_info);
+    down_write(&osfs_inode->i_extent_sem);
+    // 從 block 0 開始不需要切開 extent，不會失敗
+    osfs_extent_remove(sb_info, osfs_inode, 0, 1ULL << 32);
+    osfs_extent_destroy(osfs_inode);
+    up_write(&osfs_inode->i_extent_sem);
+
+    osfs_inode->i_mode = 0;
+    osfs_inode->i_links_count = 0;
+    osfs_image_dirty_inode(sb_info, osfs_inode->i_ino);
+    osfs_journal_free_inode(sb_info, osfs_inode->i_ino);
+    osfs_meta_end(sb_info);
+}
+
+/**
+ * Function: osfs_populate_data_block
+ * Description: Takes memory from the data pool for an allocated data block.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The block number, allocated but without memory yet.
+ *   - zero: Whether the block must be zero-filled.
+ * Returns:
+ *   - A pointer to the block's memory.
+ *   - NULL if the memory cannot be allocated.
+ */
+void *osfs_populate_data_block(struct osfs_sb_info *sb_info, uint32_t block_no, bool zero)
+{
+    void *block;
+
+    block = kmem_cache_alloc(sb_info->block_cachep, zero ? GFP_KERNEL | __GFP_ZERO : GFP_KERNEL);
+    if (!block)
+        return NULL;
+    if (xa_is_err(xa_store(&sb_info->data_pool, block_no, block, GFP_KERNEL))) {
+        kmem_cache_free(sb_info->block_cachep, block);
+        return NULL;
+    }
+    return block;
+}
+
 /**
  * Function: osfs_alloc_data_block
- * Description: Allocates a free data block from the block bitmap.
+ * Description: Allocates a free data block from the block allocator. The
+ *              memory backing the block is taken from the data pool only now,
+ *              so the pool grows with live data up to block_count blocks.
  * Inputs:
  *   - sb_info: The superblock information of the filesystem.
  *   - block_no: Pointer to store the allocated block number.
+ *   - zero: Whether the block must be zero-filled.
  * Returns:
  *   - 0 on successful allocation.
  *   - -ENOSPC if no free data block is available.
+ *   - -ENOMEM if the block memory cannot be allocated.
  */
-int osfs_alloc_data_block(struct osfs_sb_info *sb_info, uint32_t *block_no)
+int osfs_alloc_data_block(struct osfs_sb_info *sb_info, uint32_t *block_no, bool zero)
 {
-    uint32_t i;
-
-    for (i = 0; i < sb_info->block_count; i++) {
-        if (!test_bit(i, sb_info->block_bitmap)) {
-            set_bit(i, sb_info->block_bitmap);
-            sb_info->nr_free_blocks--;
-            *block_no = i;
-            return 0;
-        }
+    if (osfs_allocator_get(&sb_info->block_alloc, block_no)) {
+        pr_err("osfs_alloc_data_block: No free data block available\n");
+        return -ENOSPC;
+    }
+
+    if (!osfs_populate_data_block(sb_info, *block_no, zero)) {
+        osfs_allocator_put(&sb_info->block_alloc, *block_no);
+        return -ENOMEM;
     }
-    pr_err("osfs_alloc_data_block: No free data block available\n");
-    return -ENOSPC;
+    return 0;
 }
 
+/**
+ * Function: osfs_free_data_block
+ * Description: Returns the memory of a data block, if it is in the data pool,
+ *              to the slab cache, and the block to the block allocator once
+ *              the free is committed (see osfs_journal_free_block).
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The block number to free.
+ * Returns:
+ *   - None.
+ */
 void osfs_free_data_block(struct osfs_sb_info *sb_info, uint32_t block_no)
 {
-    clear_bit(block_no, sb_info->block_bitmap);
-    sb_info->nr_free_blocks++;
-}
\ No newline at end of file
+    void *block = xa_erase(&sb_info->data_pool, block_no);
+
+    // 釋放掉的 block 不用再寫進 image，也不用再記進 journal
+    if (sb_info->image) {
+        clear_bit(block_no, sb_info->image->dirty);
+        clear_bit(block_no, sb_info->image->log_blocks);
+        clear_bit(block_no, sb_info->image->home_blocks);
+    }
+    if (block)
+        kmem_cache_free(sb_info->block_cachep, block);
+    osfs_journal_free_block(sb_info, block_no);
+}
+
+/**
+ * Function: osfs_block_addr
+ * Description: Looks up the memory backing an allocated data block.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The block number to look up.
+ * Returns:
+ *   - A pointer to the block's memory.
+ *   - NULL if the block is not allocated.
+ */
+void *osfs_block_addr(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    return xa_load(&sb_info->data_pool, block_no);
+}
+
+/**
+ * Function: osfs_map_new_block
+ * Description: Allocates a data block and maps it at a logical block of a file.
+ *              A block kept outside the data pool gets no memory, and its
+ *              contents on the device are left as they are for the caller to
+ *              overwrite. Called with i_extent_sem held for writing.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The inode of the file.
+ *   - lblk: The logical block to map, currently a hole.
+ *   - flags: The extent flags of the new block. An OSFS_EXTENT_UNWRITTEN block
+ *            reads as zeros, so its memory is not cleared.
+ *   - pblk: Where to store the allocated physical block number.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no free data block is available.
+ *   - -ENOMEM if the block or its mapping cannot be allocated.
+ */
+int osfs_map_new_block(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                       uint32_t lblk, uint32_t flags, uint32_t *pblk)
+{
+    bool pool = osfs_in_pool(sb_info, osfs_inode);
+    int ret;
+
+    if (pool) {
+        ret = osfs_alloc_data_block(sb_info, pblk, !(flags & OSFS_EXTENT_UNWRITTEN));
+        if (ret)
+            return ret;
+    } else if (osfs_allocator_get(&sb_info->block_alloc, pblk)) {
+        return -ENOSPC;
+    }
+
+    ret = osfs_extent_insert(osfs_inode, lblk, *pblk, flags);
+    if (ret) {
+        // 還沒有 commit 看過這個 block，可以直接還回去
+        if (pool)
+            kmem_cache_free(sb_info->block_cachep, xa_erase(&sb_info->data_pool, *pblk));
+        osfs_allocator_put(&sb_info->block_alloc, *pblk);
+        return ret;
+    }
+    // 清成 0 的檔案 block 也要寫進 image，unwritten 的內容沒有意義；
+    // 目錄 block 由 osfs_add_dir_entry 記進 journal
+    if (pool && !(flags & OSFS_EXTENT_UNWRITTEN) && !S_ISDIR(osfs_inode->i_mode))
+        osfs_image_dirty_block(sb_info, *pblk);
+    osfs_inode->i_blocks++;
+    osfs_image_dirty_inode(sb_info, osfs_inode->i_ino);
+    return 0;
+}
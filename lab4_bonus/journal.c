@@ -0,0 +1,640 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/crc32c.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include "osfs.h"
+
+/*
+ * Metadata journal of an image; the format is described in osfs.h. A create
+ * changes the inode table, the parent's directory block and the parent's
+ * size at once, and a checkpoint is too heavy to run for each of them. So
+ * namespace changes and writes only mark the inodes and directory blocks
+ * they change, and a journal commit appends the marked ones as one
+ * transaction to the journal of the last checkpoint's slot: a single write
+ * and flush, however many changes it carries.
+ *
+ * Commits are grouped. Callers that want their changes on disk (fsync, and
+ * the periodic commit every commit= seconds) queue up on commit_mutex; the
+ * first runs a commit that picks up the changes of all of them, and the
+ * others find that it already covered theirs and return. File data in the
+ * data pool is written in place before the transaction that maps it; in
+ * block-device mode it is written by writeback, and fsync writes it back
+ * before it commits.
+ *
+ * The journal only grows until the next checkpoint, which starts a fresh
+ * journal in its own slot. A commit that does not fit runs a checkpoint
+ * instead.
+ */
+
+/**
+ * Function: osfs_journal_put_inode
+ * Description: Appends the inode record and the extents of an inode to the
+ *              transaction being built. An inode without links is logged as
+ *              free, as a checkpoint would save it.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number.
+ *   - room: The bytes the transaction may take.
+ *   - len: The bytes of the transaction so far, advanced past the entry.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the entry does not fit.
+ */
+static int osfs_journal_put_inode(struct osfs_sb_info *sb_info, uint32_t ino, uint64_t room,
+                                  size_t *len)
+{
+    struct osfs_inode *osfs_inode = &((struct osfs_inode *)sb_info->inode_table)[ino];
+    void *entry = sb_info->image->jbuf + *len;
+    struct osfs_disk_extent_head *head = entry;
+    struct osfs_disk_inode *rec = entry + sizeof(*head);
+    struct osfs_disk_extent *dext = entry + sizeof(*head) + sizeof(*rec);
+    struct osfs_extent ext;
+    uint64_t lblk = 0;
+    uint32_t nr = 0;
+
+    if (*len + sizeof(*head) + sizeof(*rec) > room)
+        return -ENOSPC;
+    memset(entry, 0, sizeof(*head) + sizeof(*rec));
+    head->h_ino = cpu_to_le32(ino);
+
+    if (osfs_inode->i_mode && osfs_inode->i_links_count) {
+        down_read(&osfs_inode->i_extent_sem);
+        if (*len + sizeof(*head) + sizeof(*rec) +
+            (uint64_t)osfs_inode->i_nr_extents * sizeof(*dext) > room) {
+            up_read(&osfs_inode->i_extent_sem);
+            return -ENOSPC;
+        }
+        while (lblk <= U32_MAX && osfs_extent_find(osfs_inode, lblk, &ext)) {
+            dext[nr].e_lblk = cpu_to_le32(ext.e_lblk);
+            dext[nr].e_pblk = cpu_to_le32(ext.e_pblk);
+            dext[nr].e_len = cpu_to_le32(ext.e_len);
+            dext[nr].e_flags = cpu_to_le32(osfs_extent_disk_flags(ext.e_flags));
+            nr++;
+            lblk = (uint64_t)ext.e_lblk + ext.e_len;
+        }
+        up_read(&osfs_inode->i_extent_sem);
+
+        osfs_image_pack_inode(osfs_inode, rec);
+        rec->i_nr_extents = cpu_to_le32(nr);
+        head->h_nr_extents = cpu_to_le32(nr);
+    }
+    *len += sizeof(*head) + sizeof(*rec) + (size_t)nr * sizeof(*dext);
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_build
+ * Description: Builds a transaction in the journal buffer. A journal commit
+ *              logs the inodes and directory blocks marked since the last
+ *              commit. A checkpoint saves the inodes itself and logs every
+ *              directory block not yet written in place, as the first
+ *              transaction of the journal that follows it. Logged directory
+ *              blocks stay marked to be written in place by the next
+ *              checkpoint. Called with ckpt_sem held for writing, so the
+ *              transaction is a consistent snapshot.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - checkpoint: Whether a checkpoint is building its first transaction.
+ *   - len: Where to store the bytes of the transaction, 0 if there is
+ *          nothing to log.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the transaction does not fit in the journal. The marks
+ *     already cleared are left to a checkpoint, which saves everything.
+ */
+int osfs_journal_build(struct osfs_sb_info *sb_info, bool checkpoint, size_t *len)
+{
+    struct osfs_image *image = sb_info->image;
+    struct osfs_journal_header *jh = image->jbuf;
+    uint64_t room = checkpoint ? image->journal_len : image->journal_len - image->jhead;
+    uint32_t nr_inodes = 0, nr_blocks = 0;
+    struct osfs_journal_block *jb;
+    unsigned long *blocks;
+    unsigned long ino, block;
+    size_t used = sizeof(*jh);
+    void *addr;
+    int ret;
+
+    lockdep_assert_held_write(&sb_info->ckpt_sem);
+    *len = 0;
+
+    if (checkpoint) {
+        for_each_set_bit(block, image->log_blocks, sb_info->block_count) {
+            clear_bit(block, image->log_blocks);
+            set_bit(block, image->home_blocks);
+        }
+    } else {
+        for_each_set_bit(ino, image->dirty_inodes, sb_info->inode_count) {
+            if (!test_and_clear_bit(ino, image->dirty_inodes))
+                continue;
+            ret = osfs_journal_put_inode(sb_info, ino, room, &used);
+            if (ret)
+                return ret;
+            nr_inodes++;
+        }
+    }
+
+    blocks = checkpoint ? image->home_blocks : image->log_blocks;
+    for_each_set_bit(block, blocks, sb_info->block_count) {
+        addr = osfs_block_addr(sb_info, block);
+        if (!addr)
+            continue;
+        if (used + sizeof(*jb) + sb_info->block_size > room)
+            return -ENOSPC;
+        jb = image->jbuf + used;
+        jb->b_block = cpu_to_le32(block);
+        jb->b_reserved = 0;
+        memcpy(jb + 1, addr, sb_info->block_size);
+        used += sizeof(*jb) + sb_info->block_size;
+        nr_blocks++;
+        if (!checkpoint) {
+            clear_bit(block, image->log_blocks);
+            set_bit(block, image->home_blocks);
+        }
+    }
+
+    if (!nr_inodes && !nr_blocks)
+        return 0;
+    memset(jh, 0, sizeof(*jh));
+    jh->j_magic = cpu_to_le32(OSFS_JOURNAL_MAGIC);
+    // checkpoint 的 transaction 接在它自己的 commit record 後面
+    jh->j_generation = cpu_to_le64(image->generation + checkpoint);
+    jh->j_seq = cpu_to_le64(checkpoint ? 1 : image->jseq + 1);
+    jh->j_len = cpu_to_le32(used);
+    jh->j_nr_inodes = cpu_to_le32(nr_inodes);
+    jh->j_nr_blocks = cpu_to_le32(nr_blocks);
+    *len = used;
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_write
+ * Description: Seals the transaction in the journal buffer with its checksum
+ *              and writes it, padded to OSFS_IMAGE_ALIGN, into a journal.
+ *              The caller flushes.
+ * Inputs:
+ *   - image: The image.
+ *   - slot: The slot whose journal is written.
+ *   - off: The journal offset of the transaction.
+ *   - len: The bytes of the transaction.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the file or device on failure.
+ */
+int osfs_journal_write(struct osfs_image *image, unsigned int slot, uint64_t off, size_t len)
+{
+    struct osfs_journal_header *jh = image->jbuf;
+    size_t padded = ALIGN(len, OSFS_IMAGE_ALIGN);
+
+    jh->j_checksum = 0;
+    jh->j_checksum = cpu_to_le32(crc32c(~0, image->jbuf, len));
+    memset(image->jbuf + len, 0, padded - len);
+    return osfs_image_rw(image, image->jbuf, padded, image->slots[slot].journal_off + off, true);
+}
+
+/**
+ * Function: osfs_journal_requeue
+ * Description: Marks everything for the next commit again after a commit or
+ *              checkpoint failed. The marks it cleared are no longer known, so
+ *              every inode and every directory block not yet written in place
+ *              is marked.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_requeue(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    unsigned long block;
+    uint32_t ino;
+
+    for (ino = ROOT_INODE; ino < sb_info->inode_count; ino++)
+        set_bit(ino, image->dirty_inodes);
+    for_each_set_bit(block, image->home_blocks, sb_info->block_count)
+        set_bit(block, image->log_blocks);
+}
+
+/**
+ * Function: osfs_journal_free_block
+ * Description: Gives a freed data block back to the block allocator once the
+ *              commit that records the free has reached the disk. Until then
+ *              the last commit on the image still maps the block to its old
+ *              file, and a new owner's data written over it would show up in
+ *              that file after a crash. Without an image the block is given
+ *              back at once. Only called between osfs_meta_begin and
+ *              osfs_meta_end, or for a block no commit has seen yet.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The block number to free.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_free_block(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    if (sb_info->image)
+        set_bit(block_no, sb_info->image->freed_blocks);
+    else
+        osfs_allocator_put(&sb_info->block_alloc, block_no);
+}
+
+/**
+ * Function: osfs_journal_free_inode
+ * Description: Gives the number of a deleted inode back to the inode
+ *              allocator once the commit that records the deletion has reached
+ *              the disk, like osfs_journal_free_block. Only called between
+ *              osfs_meta_begin and osfs_meta_end.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number to free.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_free_inode(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    if (sb_info->image)
+        set_bit(ino, sb_info->image->freed_inodes);
+    else
+        osfs_allocator_put(&sb_info->inode_alloc, ino);
+}
+
+/**
+ * Function: osfs_journal_take_frees
+ * Description: Hands the blocks and inodes freed so far to the commit that is
+ *              starting, which records their frees. Ones a failed commit took
+ *              stay with them, since their frees are logged again. Called
+ *              with commit_mutex held and ckpt_sem held for writing, as the
+ *              commit advances running_tid.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_take_frees(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+
+    bitmap_or(image->release_blocks, image->release_blocks, image->freed_blocks,
+              sb_info->block_count);
+    bitmap_zero(image->freed_blocks, sb_info->block_count);
+    bitmap_or(image->release_inodes, image->release_inodes, image->freed_inodes,
+              sb_info->inode_count);
+    bitmap_zero(image->freed_inodes, sb_info->inode_count);
+}
+
+/**
+ * Function: osfs_journal_release_frees
+ * Description: Gives the blocks and inodes taken by osfs_journal_take_frees
+ *              back to the allocators, after the commit that took them has
+ *              reached the disk. Called with commit_mutex held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_release_frees(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    unsigned long nr;
+
+    lockdep_assert_held(&image->commit_mutex);
+    for_each_set_bit(nr, image->release_blocks, sb_info->block_count)
+        osfs_allocator_put(&sb_info->block_alloc, nr);
+    bitmap_zero(image->release_blocks, sb_info->block_count);
+    for_each_set_bit(nr, image->release_inodes, sb_info->inode_count)
+        osfs_allocator_put(&sb_info->inode_alloc, nr);
+    bitmap_zero(image->release_inodes, sb_info->inode_count);
+}
+
+/**
+ * Function: osfs_journal_run
+ * Description: Runs one journal commit: takes the marked changes as a
+ *              transaction and writes the file data blocks they may map, both
+ *              while namespace changes and block frees are held off; then,
+ *              with those allowed again, flushes the data, appends the
+ *              transaction and flushes it. Called with commit_mutex held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from writing the image on failure.
+ */
+static int osfs_journal_run(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    bool written = false;
+    struct kvec *vec;
+    unsigned int nofs;
+    bool overflow;
+    size_t len = 0;
+    u64 tid;
+    int ret;
+
+    vec = kmalloc_array(OSFS_IMAGE_BATCH, sizeof(*vec), GFP_KERNEL);
+    if (!vec)
+        return -ENOMEM;
+
+    // 裝置上新分配的 block 先寫回資料，這個 commit 才能把它們存成 written
+    written = osfs_bdev_write_ordered(sb_info);
+    // 寫 image 時的記憶體回收不能再回頭寫 osfs
+    down_write(&sb_info->ckpt_sem);
+    nofs = memalloc_nofs_save();
+    // 從這裡開始的修改歸下一個 commit
+    tid = image->running_tid;
+    WRITE_ONCE(image->running_tid, tid + 1);
+    smp_mb();
+    osfs_journal_take_frees(sb_info);
+    ret = osfs_journal_build(sb_info, false, &len);
+    overflow = ret == -ENOSPC;
+    // 檔案資料要比指向它的 metadata 先到；寫的時候不能有 block 被釋放
+    if (!ret)
+        ret = osfs_image_save_data(image, vec, &written);
+    memalloc_nofs_restore(nofs);
+    up_write(&sb_info->ckpt_sem);
+    kfree(vec);
+
+    // journal 放不下就改做 checkpoint，它會存下所有東西並換一個空的 journal
+    if (overflow)
+        return osfs_image_checkpoint(sb_info);
+
+    nofs = memalloc_nofs_save();
+    if (!ret && len && written)
+        ret = osfs_image_flush(image);
+    if (!ret && len)
+        ret = osfs_journal_write(image, image->slot, image->jhead, len);
+    // 沒有東西要記也要 flush，fsync 的檔案資料才會落地
+    if (!ret)
+        ret = osfs_image_flush(image);
+    memalloc_nofs_restore(nofs);
+
+    if (ret) {
+        osfs_journal_requeue(sb_info);
+        pr_err("osfs_journal_run: Journal commit failed: %d\n", ret);
+        return ret;
+    }
+    if (len) {
+        image->jhead += ALIGN(len, OSFS_IMAGE_ALIGN);
+        image->jseq++;
+    }
+    image->committed_tid = tid;
+    // 釋放已經記在 disk 上，這些 block 和 inode 現在才能給別人用
+    osfs_journal_release_frees(sb_info);
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_commit
+ * Description: Makes the changes made so far by the caller durable. Callers
+ *              that arrive while a commit runs wait for it, and the first of
+ *              them then runs one commit for the rest; a caller whose changes
+ *              a completed commit already picked up returns at once.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success, or if the mount has no image.
+ *   - A negative error code from the commit on failure.
+ */
+int osfs_journal_commit(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    u64 tid;
+    int ret = 0;
+
+    if (!image || !image->active)
+        return 0;
+
+    // 自己的修改和標記先讓 commit 看得到，再看它們歸哪一個 commit
+    smp_mb();
+    tid = READ_ONCE(image->running_tid);
+    mutex_lock(&image->commit_mutex);
+    if (image->committed_tid < tid)
+        ret = osfs_journal_run(sb_info);
+    mutex_unlock(&image->commit_mutex);
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_retry_alloc
+ * Description: Commits the journal when blocks freed earlier are still kept
+ *              from the block allocator, so that an allocation that ran out of
+ *              space can get them. The caller must not hold the inode lock of
+ *              a file, which a commit in block-device mode takes.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - true if the commit released blocks and the allocation may be retried.
+ *   - false otherwise.
+ */
+bool osfs_journal_retry_alloc(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+
+    if (!image || !image->active)
+        return false;
+    if (bitmap_empty(image->freed_blocks, sb_info->block_count) &&
+        bitmap_empty(image->release_blocks, sb_info->block_count))
+        return false;
+    return !osfs_journal_commit(sb_info);
+}
+
+// Periodic journal commit; re-arms itself until osfs_image_stop
+void osfs_journal_commit_work(struct work_struct *work)
+{
+    struct osfs_image *image = container_of(to_delayed_work(work), struct osfs_image, commit_work);
+    struct osfs_sb_info *sb_info = image->sb_info;
+
+    // 閒置的時候不用每次都 flush
+    if (!bitmap_empty(image->dirty_inodes, sb_info->inode_count) ||
+        !bitmap_empty(image->log_blocks, sb_info->block_count) ||
+        !bitmap_empty(image->dirty, sb_info->block_count))
+        osfs_journal_commit(sb_info);
+    queue_delayed_work(system_long_wq, &image->commit_work,
+                       (unsigned long)image->commit_interval * HZ);
+}
+
+/**
+ * Function: osfs_journal_replay_txn
+ * Description: Applies the inode records of a transaction to the inode
+ *              table: each logged inode is replaced whole, and one logged
+ *              without a mode is free. The directory blocks are only checked
+ *              here; osfs_journal_apply_blocks puts them in place once the
+ *              data pool is loaded.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - txn: The transaction, with a valid checksum.
+ *   - len: The bytes of the transaction.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if the transaction is inconsistent.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_journal_replay_txn(struct osfs_sb_info *sb_info, const void *txn, size_t len)
+{
+    const struct osfs_journal_header *jh = txn;
+    struct osfs_inode *table = sb_info->inode_table;
+    const struct osfs_disk_extent_head *head;
+    const struct osfs_journal_block *jb;
+    const struct osfs_disk_inode *rec;
+    struct osfs_inode *osfs_inode;
+    size_t pos = sizeof(*jh);
+    uint32_t i, ino, nr;
+    int ret;
+
+    for (i = 0; i < le32_to_cpu(jh->j_nr_inodes); i++) {
+        if (len - pos < sizeof(*head) + sizeof(*rec))
+            return -EUCLEAN;
+        head = txn + pos;
+        rec = txn + pos + sizeof(*head);
+        pos += sizeof(*head) + sizeof(*rec);
+        ino = le32_to_cpu(head->h_ino);
+        nr = le32_to_cpu(head->h_nr_extents);
+        if (ino < ROOT_INODE || ino >= sb_info->inode_count || (!rec->i_mode && nr) ||
+            le32_to_cpu(rec->i_nr_extents) != nr ||
+            nr > (len - pos) / sizeof(struct osfs_disk_extent))
+            return -EUCLEAN;
+
+        osfs_inode = &table[ino];
+        osfs_extent_destroy(osfs_inode);
+        osfs_init_osfs_inode(osfs_inode, ino);
+        if (rec->i_mode) {
+            osfs_image_unpack_inode(osfs_inode, rec);
+            ret = osfs_image_restore_extents(sb_info, osfs_inode, txn + pos, nr);
+            if (ret)
+                return ret;
+        }
+        pos += (size_t)nr * sizeof(struct osfs_disk_extent);
+    }
+
+    for (i = 0; i < le32_to_cpu(jh->j_nr_blocks); i++) {
+        if (len - pos < sizeof(*jb) + sb_info->block_size)
+            return -EUCLEAN;
+        jb = txn + pos;
+        if (le32_to_cpu(jb->b_block) >= sb_info->block_count)
+            return -EUCLEAN;
+        pos += sizeof(*jb) + sb_info->block_size;
+    }
+    return pos == len ? 0 : -EUCLEAN;
+}
+
+// Whether a range of the journal exists; a new image file ends before its journals
+static bool osfs_journal_readable(struct osfs_image *image, uint64_t pos, size_t len)
+{
+    return image->bdev || pos + len <= i_size_read(file_inode(image->file));
+}
+
+/**
+ * Function: osfs_journal_replay
+ * Description: Reads the transactions of the loaded slot's journal into the
+ *              journal buffer and applies their inode records, in order.
+ *              Reading stops at the first transaction that is missing, torn,
+ *              or left from an older checkpoint; new transactions are
+ *              appended there. Called by osfs_image_load after the inode
+ *              table and extent maps of the slot are loaded.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if a transaction with a valid checksum is inconsistent.
+ *   - -ENOMEM if memory allocation fails.
+ *   - A negative error code from reading the image on failure.
+ */
+int osfs_journal_replay(struct osfs_sb_info *sb_info)
+{
+    struct osfs_image *image = sb_info->image;
+    uint64_t base = image->slots[image->slot].journal_off;
+    struct osfs_journal_header *jh;
+    uint64_t pos = 0, seq = 0;
+    size_t len, padded;
+    u32 crc;
+    int ret;
+
+    while (pos < image->journal_len) {
+        jh = image->jbuf + pos;
+        if (!osfs_journal_readable(image, base + pos, OSFS_IMAGE_ALIGN))
+            break;
+        ret = osfs_image_rw(image, jh, OSFS_IMAGE_ALIGN, base + pos, false);
+        if (ret)
+            return ret;
+        len = le32_to_cpu(jh->j_len);
+        if (le32_to_cpu(jh->j_magic) != OSFS_JOURNAL_MAGIC ||
+            le64_to_cpu(jh->j_generation) != image->generation ||
+            le64_to_cpu(jh->j_seq) != seq + 1 || len < sizeof(*jh) ||
+            len > image->journal_len - pos)
+            break;
+
+        padded = ALIGN(len, OSFS_IMAGE_ALIGN);
+        if (padded > OSFS_IMAGE_ALIGN) {
+            if (!osfs_journal_readable(image, base + pos, padded))
+                break;
+            ret = osfs_image_rw(image, (void *)jh + OSFS_IMAGE_ALIGN, padded - OSFS_IMAGE_ALIGN,
+                                base + pos + OSFS_IMAGE_ALIGN, false);
+            if (ret)
+                return ret;
+        }
+        // 沒寫完的 transaction 是 crash 前最後一個，到這裡為止
+        crc = le32_to_cpu(jh->j_checksum);
+        jh->j_checksum = 0;
+        if (crc32c(~0, jh, len) != crc)
+            break;
+        jh->j_checksum = cpu_to_le32(crc);
+
+        ret = osfs_journal_replay_txn(sb_info, jh, len);
+        if (ret)
+            return ret;
+        pos += padded;
+        seq++;
+    }
+
+    image->jhead = pos;
+    image->jseq = seq;
+    if (seq)
+        pr_info("osfs_journal_replay: Replayed %llu transactions\n", seq);
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_apply_blocks
+ * Description: Puts the directory blocks logged by the replayed transactions
+ *              over the contents loaded from their place, in transaction
+ *              order, so each ends up as last logged. A logged block that no
+ *              directory maps after the replay was freed later, and may hold
+ *              file data by now, so it is skipped.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - dir_blocks: The blocks mapped by directories.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_apply_blocks(struct osfs_sb_info *sb_info, const unsigned long *dir_blocks)
+{
+    struct osfs_image *image = sb_info->image;
+    const struct osfs_disk_extent_head *head;
+    const struct osfs_journal_header *jh;
+    const struct osfs_journal_block *jb;
+    uint32_t i, block;
+    uint64_t pos;
+    size_t off;
+    void *addr;
+
+    for (pos = 0; pos < image->jhead; pos += ALIGN(le32_to_cpu(jh->j_len), OSFS_IMAGE_ALIGN)) {
+        jh = image->jbuf + pos;
+        off = sizeof(*jh);
+        // inode records 已經在 replay 時套用過了
+        for (i = 0; i < le32_to_cpu(jh->j_nr_inodes); i++) {
+            head = (const void *)jh + off;
+            off += sizeof(*head) + sizeof(struct osfs_disk_inode) +
+                   (size_t)le32_to_cpu(head->h_nr_extents) * sizeof(struct osfs_disk_extent);
+        }
+        for (i = 0; i < le32_to_cpu(jh->j_nr_blocks); i++) {
+            jb = (const void *)jh + off;
+            block = le32_to_cpu(jb->b_block);
+            addr = test_bit(block, dir_blocks) ? osfs_block_addr(sb_info, block) : NULL;
+            if (addr)
+                memcpy(addr, jb + 1, sb_info->block_size);
+            off += sizeof(*jb) + sb_info->block_size;
+        }
+    }
+}
@@ -3,29 +3,83 @@
 
 #include <linux/types.h>      // Include basic type definitions
 #include <linux/fs.h>
+#include <linux/fs_context.h>
 #include <linux/bitmap.h>    // For bitmap operations
 #include <linux/time.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/xarray.h>
+#include <linux/rbtree.h>
+#include <linux/hash.h>
 #include <linux/string.h>
 #include <linux/module.h>
+#include <linux/percpu_counter.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/uio.h>
 
 #define OSFS_MAGIC 0x051AB520
-#define BLOCK_SIZE 4096       // Each data block size is 4KB
-#define INODE_COUNT 20         // Maximum of 20 inodes in the filesystem
-#define DATA_BLOCK_COUNT 20    // Assume there are 20 data blocks
 #define MAX_FILENAME_LEN 255
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(struct osfs_dir_entry))
-#define MAX_BLOCKS_PER_FILE 5  // 每個檔案最多可以有 5 個 blocks (20KB)
+#define OSFS_INLINE_EXTENTS 4  // Extents kept in the inode before the overflow tree is used
 
-#define BITMAP_SIZE(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+// Defaults used when the corresponding mount option is not given
+#define OSFS_DEFAULT_BLOCK_SIZE 4096   // bsize=: each data block is 4KB
+#define OSFS_DEFAULT_INODE_COUNT 20    // nr_inodes=: maximum of 20 inodes
+#define OSFS_DEFAULT_BLOCK_COUNT 20    // size=: 20 data blocks (memory is allocated on demand)
+#define OSFS_MIN_BLOCK_SIZE 512        // bsize= must be a power of two in [512, PAGE_SIZE]
+#define OSFS_DEFAULT_CKPT_INTERVAL 30  // ckpt_interval=: seconds between checkpoints to image=
+#define OSFS_MAX_CKPT_INTERVAL 86400   // ckpt_interval= may be at most a day
+#define OSFS_DEFAULT_COMMIT_INTERVAL 5 // commit=: seconds between journal commits to image=
+
+#define OSFS_MAGAZINE_SIZE 64   // Free numbers a CPU can hold in its magazine
+#define OSFS_MAGAZINE_BATCH 32  // Numbers moved between a magazine and the bitmap at once
 
-// Calculate the size of the bitmap (in units of unsigned long)
-#define INODE_BITMAP_SIZE BITMAP_SIZE(INODE_COUNT)
-#define BLOCK_BITMAP_SIZE BITMAP_SIZE(DATA_BLOCK_COUNT)
+#define BITMAP_SIZE(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
 #define ROOT_INODE 1            // Define the root inode as 1
 
+/**
+ * Struct: osfs_mount_opts
+ * Description: Geometry requested through mount options (size=, nr_inodes=, bsize=).
+ */
+struct osfs_mount_opts {
+    uint64_t size;               // Capacity of the data area in bytes
+    uint32_t inode_count;        // Total number of inodes
+    uint32_t block_size;         // Size of each data block
+    char *image;                 // image=: path of the backing file, NULL for RAM only
+    uint32_t ckpt_interval;      // ckpt_interval=: seconds between checkpoints, 0 for sync only
+    uint32_t commit_interval;    // commit=: seconds between journal commits, 0 for fsync only
+    bool format;                 // format: create a new filesystem on the block device
+};
+
+/**
+ * Struct: osfs_magazine
+ * Description: Per-CPU stack of free numbers already reserved in an allocator's bitmap.
+ */
+struct osfs_magazine {
+    spinlock_t lock;             // Only contended while the bitmap is being drained
+    uint32_t nr;                 // Number of entries in items
+    uint32_t items[OSFS_MAGAZINE_SIZE];
+};
+
+/**
+ * Struct: osfs_allocator
+ * Description: Allocator for inode numbers or data blocks: a bitmap searched
+ *              with next-fit, fronted by per-CPU magazines.
+ */
+struct osfs_allocator {
+    spinlock_t lock;             // Protects bitmap and hint
+    unsigned long *bitmap;       // Bit set: allocated or held in a magazine
+    uint32_t first;              // First number that may be allocated
+    uint32_t size;               // Number of bits in bitmap
+    uint32_t hint;               // Where the next bitmap search starts
+    struct osfs_magazine __percpu *mags;
+    struct percpu_counter nr_free; // Numbers not allocated, including those in magazines
+};
+
 /**
  * Struct: osfs_sb_info
  * Description: Superblock information for the osfs filesystem.
@@ -35,30 +89,284 @@ struct osfs_sb_info {
     uint32_t block_size;         // Size of each data block
     uint32_t inode_count;        // Total number of inodes
     uint32_t block_count;        // Total number of data blocks
-    uint32_t nr_free_inodes;     // Number of free inodes
-    uint32_t nr_free_blocks;     // Number of free data blocks
-    unsigned long *inode_bitmap; // Pointer to the inode bitmap
-    unsigned long *block_bitmap; // Pointer to the data block bitmap
+    struct osfs_allocator inode_alloc; // Inode numbers [1, inode_count)
+    struct osfs_allocator block_alloc; // Data blocks [0, block_count)
     void *inode_table;           // Pointer to the inode table
-    void *data_blocks;           // Pointer to the data blocks area
+    struct xarray data_pool;     // Block number -> block memory, filled in on allocation
+    struct kmem_cache *block_cachep; // Slab cache the data blocks are allocated from
+    struct osfs_image *image;    // Backing file or device, NULL if the filesystem lives in RAM only
+    struct block_device *bdev;   // Device mounted in block-device mode, NULL otherwise
+    struct super_block *sb;      // The VFS superblock, for looking up inodes
+    struct rw_semaphore ckpt_sem; // Shared by namespace changes, exclusive for a checkpoint
+};
+
+/*
+ * On-disk image format, used by the image= backing file and, from offset 0,
+ * by a block device mounted directly. All fields are little-endian and every
+ * region starts on an OSFS_IMAGE_ALIGN boundary:
+ *
+ *   superblock 0, superblock 1 | metadata slot 0 | metadata slot 1 |
+ *   journal 0 | journal 1 | data area
+ *
+ * where each metadata slot holds
+ *
+ *   block bitmap | inode bitmap | inode table | extent records
+ *
+ * The bitmaps are arrays of 64-bit words. The inode table has a record for
+ * every inode number. The extent records hold, for each inode in use, an
+ * osfs_disk_extent_head followed by its extents in logical block order. Data
+ * block N lives at s_data_off + N * block_size; free blocks are never written,
+ * so the data area stays sparse. On a block device the data area runs to the
+ * end of the device.
+ *
+ * Superblock i, at i * OSFS_IMAGE_SUPER_STRIDE, is the commit record of slot
+ * i. A checkpoint updates the slot not used by the last commit and then
+ * writes that slot's superblock; the valid superblock with the highest
+ * generation names the image to load, so a checkpoint cut short leaves the
+ * previous one intact. File data blocks are shared by both slots and written
+ * in place before the commit. Both superblocks are rewritten together as the
+ * first OSFS_IMAGE_ALIGN bytes, the other one unchanged, so a commit also
+ * works on devices whose sectors are larger than a superblock.
+ *
+ * Journal i holds the changes made since the checkpoint of slot i, as a
+ * sequence of transactions starting at its first byte. Each transaction is
+ * an osfs_journal_header, the inode records and extents of the inodes it
+ * changed, and the blocks of the directories it changed, padded to
+ * OSFS_IMAGE_ALIGN. Loading replays the transactions of the loaded slot's
+ * journal in order, up to the first one that is torn or belongs to an older
+ * checkpoint. Directory blocks are written in place only after a checkpoint
+ * has logged them as its first transaction, so their in-place copy is always
+ * one the replay starts from.
+ */
+#define OSFS_IMAGE_MAGIC 0x051AB5F5
+#define OSFS_IMAGE_VERSION 3
+#define OSFS_IMAGE_ALIGN 4096
+#define OSFS_IMAGE_SUPER_STRIDE 2048  // Each superblock in its own sectors
+#define OSFS_IMAGE_BATCH 256          // Data blocks per read or write call
+#define OSFS_JOURNAL_MAGIC 0x051AB5CA
+#define OSFS_JOURNAL_MIN (256 << 10)  // Journals get 1/32 of the data area within these bounds
+#define OSFS_JOURNAL_MAX (32 << 20)
+#define OSFS_IMAGE_MAX_INODES (1U << 22) // An image's geometry is capped, since a mount
+#define OSFS_IMAGE_MAX_BLOCKS (1U << 28) // sizes its tables and bitmaps from it
+
+/**
+ * Struct: osfs_disk_super
+ * Description: Superblock of an image, one per metadata slot. Written last by
+ *              a checkpoint, so it only ever describes a complete slot.
+ */
+struct osfs_disk_super {
+    __le32 s_magic;              // OSFS_IMAGE_MAGIC
+    __le32 s_version;            // OSFS_IMAGE_VERSION
+    __le32 s_block_size;
+    __le32 s_inode_count;
+    __le32 s_block_count;
+    __le32 s_checksum;           // crc32c of the structure with this field zero
+    __le64 s_generation;         // Incremented by every checkpoint
+    __le64 s_bmap_off;           // Block bitmap of this superblock's slot
+    __le64 s_imap_off;           // Inode bitmap of this superblock's slot
+    __le64 s_itable_off;         // Inode table of this superblock's slot
+    __le64 s_extent_off;         // Extent records of this superblock's slot
+    __le64 s_extent_len;         // Bytes of extent records in use
+    __le64 s_data_off;           // Data area
+    __le64 s_journal_off;        // Journal of this superblock's slot
+    __le64 s_journal_len;        // Bytes of each journal
+};
+
+/**
+ * Struct: osfs_disk_inode
+ * Description: Inode table record of an image. A zero i_mode marks a free inode.
+ */
+struct osfs_disk_inode {
+    __le16 i_mode;
+    __le16 i_links_count;
+    __le32 i_uid;
+    __le32 i_gid;
+    __le32 i_nr_extents;         // Number of extents recorded for the inode
+    __le64 i_size;
+    __le64 i_atime;
+    __le64 i_mtime;
+    __le64 i_ctime;
+    __le32 i_atime_nsec;
+    __le32 i_mtime_nsec;
+    __le32 i_ctime_nsec;
+    __le32 i_reserved;
+};
+
+// Starts the extents of one inode in the extent records
+struct osfs_disk_extent_head {
+    __le32 h_ino;
+    __le32 h_nr_extents;
+};
+
+struct osfs_disk_extent {
+    __le32 e_lblk;
+    __le32 e_pblk;
+    __le32 e_len;
+    __le32 e_flags;
+};
+
+/**
+ * Struct: osfs_journal_header
+ * Description: Starts a journal transaction. It is followed by j_nr_inodes
+ *              entries of an osfs_disk_extent_head, an osfs_disk_inode and
+ *              h_nr_extents extents, then by j_nr_blocks entries of an
+ *              osfs_journal_block and block_size bytes of block contents.
+ */
+struct osfs_journal_header {
+    __le32 j_magic;              // OSFS_JOURNAL_MAGIC
+    __le32 j_checksum;           // crc32c of the j_len bytes with this field zero
+    __le64 j_generation;         // Generation of the checkpoint the journal follows
+    __le64 j_seq;                // 1 for the first transaction after that checkpoint
+    __le32 j_len;                // Bytes of the transaction before padding
+    __le32 j_nr_inodes;
+    __le32 j_nr_blocks;
+    __le32 j_reserved;
+};
+
+struct osfs_journal_block {
+    __le32 b_block;              // Data block the contents that follow belong to
+    __le32 b_reserved;
+};
+
+/**
+ * Struct: osfs_image_slot
+ * Description: Where a metadata slot lives in the image and what it holds.
+ */
+struct osfs_image_slot {
+    uint64_t bmap_off;
+    uint64_t imap_off;
+    uint64_t itable_off;
+    uint64_t extent_off;
+    uint64_t journal_off;
+    u64 *chunk_hash;             // xxh64 of each OSFS_IMAGE_ALIGN chunk as on disk, 0 if unknown
+};
+
+/**
+ * Struct: osfs_image
+ * Description: Backing file or block device of a mount and where each region
+ *              of it lives.
+ */
+struct osfs_image {
+    struct file *file;           // Backing file, NULL in block-device mode
+    struct block_device *bdev;   // Device in block-device mode, NULL otherwise
+    void *supers;                // Both superblocks as last written, OSFS_IMAGE_ALIGN bytes
+    struct osfs_sb_info *sb_info;
+    uint64_t generation;         // Generation of the last checkpoint written or loaded
+    unsigned int slot;           // Slot of that checkpoint
+    bool loaded;                 // The mount restored an existing image
+    bool active;                 // Mounted successfully, checkpoints may run
+    uint64_t extent_len;         // Bytes of extent records in the loaded image
+    struct osfs_image_slot slots[2];
+    uint64_t meta_len;           // Bytes of one metadata slot
+    uint64_t extent_max;         // Room for the extent records of a full filesystem
+    uint64_t data_off;
+    unsigned long *dirty;        // File data blocks modified since they were last written
+    unsigned int interval;       // Seconds between periodic checkpoints, 0 for none
+    struct delayed_work ckpt_work;
+    uint64_t journal_len;        // Bytes of each journal
+    void *jbuf;                  // journal_len bytes for the transaction being built or replayed
+    uint64_t jhead;              // Bytes of the loaded slot's journal in use
+    uint64_t jseq;               // Sequence number of the last transaction in it
+    unsigned long *dirty_inodes; // Inodes changed since the last commit
+    unsigned long *ordered_inodes; // Inodes with OSFS_EXTENT_NEW blocks, block-device mode only
+    unsigned long *log_blocks;   // Directory blocks changed since the last commit
+    unsigned long *home_blocks;  // Directory blocks logged but not yet written in place
+    unsigned long *freed_blocks; // Blocks freed since the running commit began, kept from the allocator
+    unsigned long *freed_inodes; // Inodes freed since the running commit began, kept from the allocator
+    unsigned long *release_blocks; // Frees picked up by a started commit, released once one commits
+    unsigned long *release_inodes;
+    struct mutex commit_mutex;   // Serializes journal commits and checkpoints
+    u64 running_tid;             // Commit that will pick up the changes made now
+    u64 committed_tid;           // Last commit that reached the disk
+    unsigned int commit_interval; // Seconds between periodic journal commits, 0 for none
+    struct delayed_work commit_work;
 };
 
 /**
  * Struct: osfs_dir_entry
- * Description: Directory entry structure.
+ * Description: Variable-length directory entry record. The records of a
+ *              directory block cover the whole block; rec_len includes any
+ *              free space left after the name.
  */
 struct osfs_dir_entry {
-    char filename[MAX_FILENAME_LEN]; // File name
-    uint32_t inode_no;               // Corresponding inode number
+    uint32_t inode_no;               // Corresponding inode number, 0 if the record is unused
+    uint32_t name_hash;              // full_name_hash() of filename
+    uint16_t rec_len;                // Bytes from this record to the next one in the block
+    uint8_t name_len;                // Length of filename
+    uint8_t file_type;               // DT_* type of the inode
+    char filename[];                 // File name, not NUL-terminated
 };
 
+// Directory records are 4-byte aligned and tile each directory block
+#define OSFS_DIR_ALIGN 4
+#define OSFS_DIR_REC_LEN(name_len) \
+    ALIGN(offsetof(struct osfs_dir_entry, filename) + (name_len), OSFS_DIR_ALIGN)
+
+/**
+ * Struct: osfs_dir_index_entry
+ * Description: Maps the name hash of a directory entry to its position in the directory.
+ */
+struct osfs_dir_index_entry {
+    struct hlist_node node;
+    uint32_t hash;                   // Name hash of the entry
+    uint32_t pos;                    // Byte offset of the entry in the directory
+};
+
+// Number of free-space size classes a directory index sorts its blocks into
+#define OSFS_DIR_ROOM_CLASSES 10
+
+/**
+ * Struct: osfs_dir_index
+ * Description: In-memory hash index over the entries of a directory.
+ */
+struct osfs_dir_index {
+    unsigned int bits;               // log2 of the number of buckets
+    uint32_t count;                  // Number of indexed entries
+    struct hlist_head *buckets;
+    uint32_t *block_free;            // Largest gap in each directory block
+    unsigned long *roomy[OSFS_DIR_ROOM_CLASSES]; // Per size class, blocks with that much room
+    uint32_t nr_blocks;              // Number of directory blocks tracked
+    uint32_t blocks_cap;             // Capacity of block_free and roomy
+    uint32_t last_block;             // Block the last entry was added to
+};
+
+// Iterates over the index entries whose name hash equals hash
+#define osfs_dir_index_for_each_possible(index, entry, hash)                        \
+    hlist_for_each_entry(entry, &(index)->buckets[hash_32((hash), (index)->bits)], node) \
+        if ((entry)->hash != (hash)) {} else
+
+#define OSFS_EXTENT_UNWRITTEN 0x1  // Blocks are reserved but read as zeros until written back
+// In memory only: blocks allocated on a block device whose data has not been
+// written back yet. They read as data, but are saved as unwritten.
+#define OSFS_EXTENT_NEW 0x80000000
+
+// The flags an extent is saved with in an image or journal
+static inline uint32_t osfs_extent_disk_flags(uint32_t flags)
+{
+    return flags & OSFS_EXTENT_NEW ? OSFS_EXTENT_UNWRITTEN : flags;
+}
+
+/**
+ * Struct: osfs_extent
+ * Description: Maps e_len consecutive logical blocks of a file, starting at
+ *              e_lblk, onto consecutive physical blocks starting at e_pblk.
+ */
+struct osfs_extent {
+    uint32_t e_lblk;                    // First logical block
+    uint32_t e_pblk;                    // First physical block
+    uint32_t e_len;                     // Number of blocks
+    uint32_t e_flags;                   // OSFS_EXTENT_* flags
+};
+
+struct osfs_extent_node;
+
 /**
  * Struct: osfs_inode
  * Description: Filesystem-specific inode structure.
  */
 struct osfs_inode {
     uint32_t i_ino;                     // Inode number
-    uint32_t i_size;                    // File size in bytes
+    uint64_t i_size;                    // File size in bytes
     uint32_t i_blocks;                  // Number of blocks occupied by the file
     uint16_t i_mode;                    // File mode (permissions and type)
     uint16_t i_links_count;             // Number of hard links
@@ -66,18 +374,178 @@ struct osfs_inode {
     uint32_t i_gid;                     // Group ID of owner
     struct timespec64 __i_atime;        // Last access time
     struct timespec64 __i_mtime;        // Last modification time
-    struct timespec64 __i_ctime;        // Creation time   
-    uint32_t blocks[MAX_BLOCKS_PER_FILE]; // uint32_t i_block 改成陣列
+    struct timespec64 __i_ctime;        // Creation time
+    uint32_t i_nr_extents;              // Number of extents mapping the file
+    struct osfs_extent i_extents[OSFS_INLINE_EXTENTS]; // Inline extents, sorted by e_lblk
+    struct rb_root i_extent_tree;       // Overflow tree; holds all extents once non-empty
+    struct osfs_extent_node *i_extent_cursor; // Last tree extent hit by a lookup
+    struct rw_semaphore i_extent_sem;   // Protects the extent map
+};
+
+/**
+ * Struct: osfs_inode_info
+ * Description: In-memory inode, allocated from the osfs inode cache with the
+ *              VFS inode embedded. Holds the state that only matters while the
+ *              inode is in memory.
+ */
+struct osfs_inode_info {
+    struct osfs_inode *i_raw;           // Entry in the inode table
+    struct osfs_dir_index *i_dir_index; // Directories only: name hash index, built on first use
+    struct rw_semaphore i_dir_sem;      // Directories only: protects the entries and i_dir_index
+    struct inode vfs_inode;
 };
 
+static inline struct osfs_inode_info *OSFS_I(struct inode *inode)
+{
+    return container_of(inode, struct osfs_inode_info, vfs_inode);
+}
+
+int osfs_allocator_init(struct osfs_allocator *alloc, uint32_t first, uint32_t size);
+void osfs_allocator_destroy(struct osfs_allocator *alloc);
+void osfs_allocator_mark_used(struct osfs_allocator *alloc, uint32_t nr);
+int osfs_allocator_get(struct osfs_allocator *alloc, uint32_t *nr);
+void osfs_allocator_put(struct osfs_allocator *alloc, uint32_t nr);
+void osfs_allocator_load(struct osfs_allocator *alloc, const u64 *words);
 struct inode *osfs_iget(struct super_block *sb, unsigned long ino);
 struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino);
+void osfs_init_osfs_inode(struct osfs_inode *osfs_inode, uint32_t ino);
+void osfs_release_inode(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode);
 int osfs_get_free_inode(struct osfs_sb_info *sb_info);
-int osfs_alloc_data_block(struct osfs_sb_info *sb_info, uint32_t *block_no);
-int osfs_fill_super(struct super_block *sb, void *data, int silent);
+int osfs_alloc_data_block(struct osfs_sb_info *sb_info, uint32_t *block_no, bool zero);
+void *osfs_populate_data_block(struct osfs_sb_info *sb_info, uint32_t block_no, bool zero);
+int osfs_fill_super(struct super_block *sb, struct fs_context *fc);
+void osfs_free_sb_info(struct osfs_sb_info *sb_info);
 struct inode *osfs_new_inode(const struct inode *dir, umode_t mode);
 void osfs_free_data_block(struct osfs_sb_info *sb_info, uint32_t block_no);
-void osfs_destroy_inode(struct inode *inode);
+void *osfs_block_addr(struct osfs_sb_info *sb_info, uint32_t block_no);
+uint32_t osfs_extent_lookup(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t *pblk,
+                            uint32_t *flags);
+int osfs_extent_insert(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t pblk, uint32_t flags);
+bool osfs_extent_find(struct osfs_inode *osfs_inode, uint32_t lblk, struct osfs_extent *ext);
+int osfs_extent_restore(struct osfs_inode *osfs_inode, const struct osfs_extent *ext);
+int osfs_extent_remove(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                       uint32_t lblk, uint64_t len);
+int osfs_extent_set_flags(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t len,
+                          uint32_t flags);
+bool osfs_extent_clear_new(struct osfs_inode *osfs_inode);
+void osfs_extent_shift(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t shift);
+void osfs_extent_destroy(struct osfs_inode *osfs_inode);
+struct osfs_dir_index *osfs_dir_index_create(void);
+int osfs_dir_index_add(struct osfs_dir_index *index, uint32_t hash, uint32_t pos);
+struct osfs_dir_index_entry *osfs_dir_index_find(struct osfs_dir_index *index, uint32_t hash, uint32_t pos);
+void osfs_dir_index_del(struct osfs_dir_index *index, uint32_t hash, uint32_t pos);
+int osfs_dir_index_set_free(struct osfs_dir_index *index, uint32_t block, uint32_t free);
+bool osfs_dir_index_find_room(struct osfs_dir_index *index, uint32_t rec_len, uint32_t *block);
+void osfs_dir_index_destroy(struct osfs_dir_index *index);
+int osfs_map_new_block(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                       uint32_t lblk, uint32_t flags, uint32_t *pblk);
+int osfs_image_open(struct osfs_sb_info *sb_info, const char *path, bool format);
+int osfs_image_load(struct osfs_sb_info *sb_info);
+int osfs_image_save(struct osfs_sb_info *sb_info);
+int osfs_image_checkpoint(struct osfs_sb_info *sb_info);
+void osfs_image_start(struct osfs_sb_info *sb_info, unsigned int interval,
+                      unsigned int commit_interval);
+void osfs_image_stop(struct osfs_sb_info *sb_info);
+void osfs_image_close(struct osfs_sb_info *sb_info);
+int osfs_image_rw(struct osfs_image *image, void *buf, size_t len, loff_t pos, bool write);
+int osfs_image_flush(struct osfs_image *image);
+int osfs_image_save_data(struct osfs_image *image, struct kvec *vec, bool *written);
+void osfs_image_pack_inode(const struct osfs_inode *osfs_inode, struct osfs_disk_inode *rec);
+void osfs_image_unpack_inode(struct osfs_inode *osfs_inode, const struct osfs_disk_inode *rec);
+int osfs_image_restore_extents(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                               const struct osfs_disk_extent *dext, uint32_t nr);
+int osfs_journal_build(struct osfs_sb_info *sb_info, bool checkpoint, size_t *len);
+int osfs_journal_write(struct osfs_image *image, unsigned int slot, uint64_t off, size_t len);
+void osfs_journal_requeue(struct osfs_sb_info *sb_info);
+int osfs_journal_commit(struct osfs_sb_info *sb_info);
+void osfs_journal_free_block(struct osfs_sb_info *sb_info, uint32_t block_no);
+void osfs_journal_free_inode(struct osfs_sb_info *sb_info, uint32_t ino);
+void osfs_journal_take_frees(struct osfs_sb_info *sb_info);
+void osfs_journal_release_frees(struct osfs_sb_info *sb_info);
+bool osfs_journal_retry_alloc(struct osfs_sb_info *sb_info);
+void osfs_journal_commit_work(struct work_struct *work);
+int osfs_journal_replay(struct osfs_sb_info *sb_info);
+void osfs_journal_apply_blocks(struct osfs_sb_info *sb_info, const unsigned long *dir_blocks);
+bool osfs_bdev_write_ordered(struct osfs_sb_info *sb_info);
+int osfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+int osfs_init_inode_cache(void);
+void osfs_destroy_inode_cache(void);
+void osfs_evict_inode(struct inode *inode);
+
+// st_blocks counts 512-byte sectors while osfs_inode->i_blocks counts data blocks
+static inline void osfs_set_i_blocks(struct inode *inode, const struct osfs_inode *osfs_inode)
+{
+    inode->i_blocks = (blkcnt_t)osfs_inode->i_blocks << (inode->i_blkbits - 9);
+}
+
+/*
+ * Namespace changes (create, link count updates, inode release) run between
+ * osfs_meta_begin and osfs_meta_end, so that a checkpoint never sees one half
+ * done. Data blocks are only freed in there too, so a checkpoint can read any
+ * mapped block. Calls must not nest: an iput that may evict, and a
+ * mark_inode_dirty, whose osfs_dirty_inode copies the attributes in its own
+ * section, go after osfs_meta_end.
+ */
+static inline void osfs_meta_begin(struct osfs_sb_info *sb_info)
+{
+    down_read(&sb_info->ckpt_sem);
+}
+
+static inline void osfs_meta_end(struct osfs_sb_info *sb_info)
+{
+    up_read(&sb_info->ckpt_sem);
+}
+
+/*
+ * Marks a data block for the next checkpoint. Call it after the block has been
+ * modified: the checkpoint clears the mark before it reads the block, so a
+ * change made after the mark was cleared is marked again.
+ */
+static inline void osfs_image_dirty_block(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    if (!sb_info->image)
+        return;
+    smp_mb__before_atomic();
+    set_bit(block_no, sb_info->image->dirty);
+}
+
+/*
+ * Marks an inode for the next journal commit, after its inode table entry or
+ * extent map has changed; the commit clears the mark before it reads them.
+ * Changes made between osfs_meta_begin and osfs_meta_end may mark before or
+ * after, as no commit runs in between.
+ */
+static inline void osfs_image_dirty_inode(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    if (!sb_info->image)
+        return;
+    smp_mb__before_atomic();
+    set_bit(ino, sb_info->image->dirty_inodes);
+}
+
+// Marks a directory block for the next journal commit; only called between osfs_meta_begin and osfs_meta_end
+static inline void osfs_image_log_block(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    if (sb_info->image)
+        set_bit(block_no, sb_info->image->log_blocks);
+}
+
+/*
+ * Whether the data blocks of an inode are kept in the data pool. In
+ * block-device mode only directories are: regular file data goes through the
+ * page cache straight to the device's data area, so it may exceed RAM.
+ */
+static inline bool osfs_in_pool(struct osfs_sb_info *sb_info, const struct osfs_inode *osfs_inode)
+{
+    return !sb_info->bdev || S_ISDIR(osfs_inode->i_mode);
+}
+
+// Device block, in units of block_size, holding data block block_no in block-device mode
+static inline sector_t osfs_disk_block(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    return (sb_info->image->data_off >> ilog2(sb_info->block_size)) + block_no;
+}
+
 // External Operations Structures
 
 extern const struct inode_operations osfs_file_inode_operations;
@@ -85,5 +553,13 @@ extern const struct file_operations osfs_file_operations;
 extern const struct inode_operations osfs_dir_inode_operations;
 extern const struct file_operations osfs_dir_operations;
 extern const struct super_operations osfs_super_ops;
+extern const struct address_space_operations osfs_aops;
+extern const struct address_space_operations osfs_bdev_aops;
+
+// Address space operations for regular files of a mount
+static inline const struct address_space_operations *osfs_file_aops(struct super_block *sb)
+{
+    return sb->s_bdev ? &osfs_bdev_aops : &osfs_aops;
+}
 
 #endif /* _osfs_H */
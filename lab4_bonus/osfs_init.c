@@ -1,22 +1,23 @@
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/fs_parser.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/blkdev.h>
+#include <linux/capability.h>
+#include <linux/user_namespace.h>
 #include "osfs.h"
 
 /**
- * Function: osfs_mount
- * Description: Mounts the osfs filesystem.
+ * Function: osfs_init_fs_context
+ * Description: Sets up the filesystem context for a new osfs mount.
  * Inputs:
- *   - fs_type: The file system type structure.
- *   - flags: Mount flags.
- *   - dev_name: Device name (not used in nodev filesystem).
- *   - data: Data passed during mount.
+ *   - fc: The filesystem context being created.
  * Returns:
- *   - A dentry pointer to the root of the mounted filesystem.
+ *   - 0 on success.
+ *   - -ENOMEM if the mount options cannot be allocated.
  */
-static struct dentry *osfs_mount(struct file_system_type *fs_type,
-                                 int flags,
-                                 const char *dev_name,
-                                 void *data);
+static int osfs_init_fs_context(struct fs_context *fc);
 
 /**
  * Function: osfs_kill_superblock
@@ -28,6 +29,45 @@ static struct dentry *osfs_mount(struct file_system_type *fs_type,
  */
 static void osfs_kill_superblock(struct super_block *sb);
 
+enum osfs_param {
+    Opt_size,
+    Opt_nr_inodes,
+    Opt_bsize,
+    Opt_image,
+    Opt_ckpt_interval,
+    Opt_commit,
+    Opt_format,
+};
+
+/**
+ * Struct: osfs_fs_parameters
+ * Description: Mount options understood by osfs.
+ *   - size=: Capacity of the data area in bytes, with an optional k/m/g suffix.
+ *   - nr_inodes=: Maximum number of inodes, with an optional k/m/g suffix.
+ *   - bsize=: Data block size, a power of two between 512 and PAGE_SIZE.
+ *   - image=: Backing file the filesystem is checkpointed to and restored from.
+ *             An existing image keeps its own size, nr_inodes and bsize. Not
+ *             allowed when mounting a block device, which is its own image
+ *             and sizes the data area to the device instead of size=.
+ *   - ckpt_interval=: Seconds between periodic checkpoints to image=, 0 to
+ *                     checkpoint on sync and unmount only.
+ *   - commit=: Seconds between periodic journal commits to image=, 0 to
+ *              commit on fsync only.
+ *   - format: Create a new filesystem on the mounted block device, replacing
+ *             whatever it holds. Without it a device must already hold an
+ *             osfs image.
+ */
+static const struct fs_parameter_spec osfs_fs_parameters[] = {
+    fsparam_string("size", Opt_size),
+    fsparam_string("nr_inodes", Opt_nr_inodes),
+    fsparam_u32("bsize", Opt_bsize),
+    fsparam_string("image", Opt_image),
+    fsparam_u32("ckpt_interval", Opt_ckpt_interval),
+    fsparam_u32("commit", Opt_commit),
+    fsparam_flag("format", Opt_format),
+    {}
+};
+
 /**
  * Struct: osfs_type
  * Description: Defines the file system type for osfs.
@@ -35,7 +75,8 @@ static void osfs_kill_superblock(struct super_block *sb);
 struct file_system_type osfs_type = {
     .owner = THIS_MODULE,
     .name = "osfs",
-    .mount = osfs_mount,
+    .init_fs_context = osfs_init_fs_context,
+    .parameters = osfs_fs_parameters,
     .kill_sb = osfs_kill_superblock,
     .fs_flags = FS_USERNS_MOUNT,
 };
@@ -53,9 +94,16 @@ static int __init osfs_init(void)
 {
     int ret;
 
+    ret = osfs_init_inode_cache();
+    if (ret) {
+        pr_err("Failed to create inode cache\n");
+        return ret;
+    }
+
     ret = register_filesystem(&osfs_type);
     if (ret) {
         pr_err("Failed to register filesystem\n");
+        osfs_destroy_inode_cache();
         return ret;
     }
 
@@ -80,25 +128,181 @@ static void __exit osfs_exit(void)
         pr_err("Failed to unregister filesystem\n");
     else
         pr_info("osfs: Successfully unregistered\n");
+    osfs_destroy_inode_cache();
 }
 
 /**
- * Function: osfs_mount
- * Description: Handles the mounting of the osfs filesystem.
+ * Function: osfs_parse_param
+ * Description: Parses a single mount option into the mount options of the context.
  * Inputs:
- *   - fs_type: The file system type structure.
- *   - flags: Mount flags.
- *   - dev_name: Device name (not used in nodev filesystem).
- *   - data: Data passed during mount.
+ *   - fc: The filesystem context being configured.
+ *   - param: The mount option to parse.
  * Returns:
- *   - A dentry pointer to the root of the mounted filesystem.
+ *   - 0 on success.
+ *   - -EINVAL if the option is unknown or its value is malformed.
  */
-static struct dentry *osfs_mount(struct file_system_type *fs_type,
-                                 int flags,
-                                 const char *dev_name,
-                                 void *data)
+static int osfs_parse_param(struct fs_context *fc, struct fs_parameter *param)
 {
-    return mount_nodev(fs_type, flags, data, osfs_fill_super);
+    struct osfs_mount_opts *opts = fc->fs_private;
+    struct fs_parse_result result;
+    unsigned long long value;
+    char *rest;
+    int opt;
+
+    opt = fs_parse(fc, osfs_fs_parameters, param, &result);
+    if (opt < 0)
+        return opt;
+
+    switch (opt) {
+    case Opt_size:
+        value = memparse(param->string, &rest);
+        if (*rest || value == 0)
+            return invalfc(fc, "Bad value for size: %s", param->string);
+        opts->size = value;
+        break;
+    case Opt_nr_inodes:
+        value = memparse(param->string, &rest);
+        if (*rest || value > U32_MAX)
+            return invalfc(fc, "Bad value for nr_inodes: %s", param->string);
+        opts->inode_count = value;
+        break;
+    case Opt_bsize:
+        if (!is_power_of_2(result.uint_32) ||
+            result.uint_32 < OSFS_MIN_BLOCK_SIZE || result.uint_32 > PAGE_SIZE)
+            return invalfc(fc, "bsize must be a power of two between %d and %lu",
+                           OSFS_MIN_BLOCK_SIZE, PAGE_SIZE);
+        opts->block_size = result.uint_32;
+        break;
+    case Opt_image:
+        // 接手 fs_parser 配置的字串，由 osfs_free_fc 釋放
+        kfree(opts->image);
+        opts->image = param->string;
+        param->string = NULL;
+        break;
+    case Opt_ckpt_interval:
+        if (result.uint_32 > OSFS_MAX_CKPT_INTERVAL)
+            return invalfc(fc, "ckpt_interval must be at most %d seconds",
+                           OSFS_MAX_CKPT_INTERVAL);
+        opts->ckpt_interval = result.uint_32;
+        break;
+    case Opt_commit:
+        if (result.uint_32 > OSFS_MAX_CKPT_INTERVAL)
+            return invalfc(fc, "commit must be at most %d seconds", OSFS_MAX_CKPT_INTERVAL);
+        opts->commit_interval = result.uint_32;
+        break;
+    case Opt_format:
+        opts->format = true;
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_get_tree
+ * Description: Validates the combined mount options and creates the superblock.
+ *              A source naming a block device mounts the filesystem stored on
+ *              it; any other source mounts a filesystem in RAM. Only a
+ *              CAP_SYS_ADMIN caller in the initial user namespace may mount a
+ *              device or name an image= file, since the image is parsed by
+ *              the kernel.
+ * Inputs:
+ *   - fc: The filesystem context being mounted.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the requested geometry is unusable.
+ *   - -EPERM if an unprivileged caller names a block device or an image.
+ *   - A negative error code from osfs_fill_super on failure.
+ */
+static int osfs_get_tree(struct fs_context *fc)
+{
+    struct osfs_mount_opts *opts = fc->fs_private;
+    uint64_t block_count = div_u64(opts->size, opts->block_size);
+    bool privileged;
+    dev_t dev;
+
+    // Room for at least the root directory and one more inode and block
+    if (opts->inode_count <= ROOT_INODE + 1)
+        return invalfc(fc, "nr_inodes must be at least %d", ROOT_INODE + 2);
+    if (block_count < 2 || block_count > U32_MAX)
+        return invalfc(fc, "size must hold between 2 and %u blocks of %u bytes",
+                       U32_MAX, opts->block_size);
+
+    // FS_USERNS_MOUNT 只給 RAM 掛載用，image 不能讓任何人都拿來解析
+    privileged = fc->user_ns == &init_user_ns && capable(CAP_SYS_ADMIN);
+
+    // 來源是 block device 就掛在裝置上，否則照舊只在記憶體裡
+    if (fc->source && !lookup_bdev(fc->source, &dev)) {
+        if (!privileged) {
+            errorfc(fc, "Mounting a block device requires CAP_SYS_ADMIN");
+            return -EPERM;
+        }
+        if (opts->image)
+            return invalfc(fc, "image= cannot be used with a block device");
+        return get_tree_bdev(fc, osfs_fill_super);
+    }
+    if (opts->format)
+        return invalfc(fc, "format only applies to a block device");
+    if (opts->image && !privileged) {
+        errorfc(fc, "image= requires CAP_SYS_ADMIN");
+        return -EPERM;
+    }
+    return get_tree_nodev(fc, osfs_fill_super);
+}
+
+/**
+ * Function: osfs_free_fc
+ * Description: Releases the mount options attached to a filesystem context.
+ * Inputs:
+ *   - fc: The filesystem context being destroyed.
+ * Returns:
+ *   - None.
+ */
+static void osfs_free_fc(struct fs_context *fc)
+{
+    struct osfs_mount_opts *opts = fc->fs_private;
+
+    if (opts)
+        kfree(opts->image);
+    kfree(fc->fs_private);
+}
+
+/**
+ * Struct: osfs_context_ops
+ * Description: Filesystem context operations used to mount osfs.
+ */
+static const struct fs_context_operations osfs_context_ops = {
+    .parse_param = osfs_parse_param,
+    .get_tree = osfs_get_tree,
+    .free = osfs_free_fc,
+};
+
+/**
+ * Function: osfs_init_fs_context
+ * Description: Sets up the filesystem context for a new osfs mount, starting
+ *              from the default geometry.
+ * Inputs:
+ *   - fc: The filesystem context being created.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the mount options cannot be allocated.
+ */
+static int osfs_init_fs_context(struct fs_context *fc)
+{
+    struct osfs_mount_opts *opts;
+
+    opts = kzalloc(sizeof(*opts), GFP_KERNEL);
+    if (!opts)
+        return -ENOMEM;
+
+    opts->size = (uint64_t)OSFS_DEFAULT_BLOCK_COUNT * OSFS_DEFAULT_BLOCK_SIZE;
+    opts->inode_count = OSFS_DEFAULT_INODE_COUNT;
+    opts->block_size = OSFS_DEFAULT_BLOCK_SIZE;
+    opts->ckpt_interval = OSFS_DEFAULT_CKPT_INTERVAL;
+    opts->commit_interval = OSFS_DEFAULT_COMMIT_INTERVAL;
+
+    fc->fs_private = opts;
+    fc->ops = &osfs_context_ops;
+    return 0;
 }
 
 /**
@@ -115,10 +319,20 @@ static void osfs_kill_superblock(struct super_block *sb)
 
     pr_info("osfs_kill_superblock: Unmounting file system\n");
 
+    // 定期 checkpoint 先停下來，卸載時的 sync 會做最後一次
+    if (sb_info)
+        osfs_image_stop(sb_info);
+
+    // 先讓 VFS 寫回並釋放所有 inode，之後才能釋放 sb_info
+    if (sb->s_bdev)
+        kill_block_super(sb);
+    else
+        kill_anon_super(sb);
+
     if (sb_info) {
         pr_info("osfs_kill_superblock: free blcok \n");
 
-        vfree(sb_info);
+        osfs_free_sb_info(sb_info);
         sb->s_fs_info = NULL;
     }
 
@@ -1,91 +1,338 @@
 #include <linux/fs.h>
 #include <linux/pagemap.h>
 #include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/statfs.h>
 #include "osfs.h"
 
+static struct kmem_cache *osfs_inode_cachep;
+
+// Runs once per slab object, not on every allocation
+static void osfs_inode_init_once(void *obj)
+{
+    struct osfs_inode_info *info = obj;
+
+    init_rwsem(&info->i_dir_sem);
+    inode_init_once(&info->vfs_inode);
+}
+
+/**
+ * Function: osfs_init_inode_cache
+ * Description: Creates the slab cache in-memory inodes are allocated from.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the cache cannot be created.
+ */
+int osfs_init_inode_cache(void)
+{
+    osfs_inode_cachep = kmem_cache_create("osfs_inode_cache", sizeof(struct osfs_inode_info), 0,
+                                          SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT,
+                                          osfs_inode_init_once);
+    return osfs_inode_cachep ? 0 : -ENOMEM;
+}
+
+/**
+ * Function: osfs_destroy_inode_cache
+ * Description: Destroys the inode slab cache once every inode has been freed.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - None.
+ */
+void osfs_destroy_inode_cache(void)
+{
+    // free_inode 在 RCU grace period 之後才執行，要等它們全部跑完
+    rcu_barrier();
+    kmem_cache_destroy(osfs_inode_cachep);
+}
+
+/**
+ * Function: osfs_alloc_inode
+ * Description: Allocates an in-memory inode from the osfs inode cache.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ * Returns:
+ *   - A pointer to the embedded VFS inode.
+ *   - NULL if memory allocation fails.
+ */
+static struct inode *osfs_alloc_inode(struct super_block *sb)
+{
+    struct osfs_inode_info *info;
+
+    info = alloc_inode_sb(sb, osfs_inode_cachep, GFP_KERNEL);
+    if (!info)
+        return NULL;
+    info->i_raw = NULL;
+    info->i_dir_index = NULL;
+    return &info->vfs_inode;
+}
+
+/**
+ * Function: osfs_free_inode
+ * Description: Returns an in-memory inode to the osfs inode cache.
+ * Inputs:
+ *   - inode: The inode to free.
+ * Returns:
+ *   - None.
+ */
+static void osfs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(osfs_inode_cachep, OSFS_I(inode));
+}
+
+/**
+ * Function: osfs_statfs
+ * Description: Reports the capacity and free space of the filesystem. The
+ *              free counts come from the allocators' per-CPU counters, summed
+ *              so they include numbers parked in the CPU magazines.
+ * Inputs:
+ *   - dentry: Any dentry of the filesystem.
+ *   - buf: Where to store the statistics.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct super_block *sb = dentry->d_sb;
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+
+    buf->f_type = sb->s_magic;
+    buf->f_bsize = sb_info->block_size;
+    buf->f_frsize = sb_info->block_size;
+    buf->f_blocks = sb_info->block_count;
+    buf->f_bfree = percpu_counter_sum_positive(&sb_info->block_alloc.nr_free);
+    buf->f_bavail = buf->f_bfree;
+    // inode 0 不使用
+    buf->f_files = sb_info->inode_count - ROOT_INODE;
+    buf->f_ffree = percpu_counter_sum_positive(&sb_info->inode_alloc.nr_free);
+    buf->f_namelen = MAX_FILENAME_LEN;
+    buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_dev));
+    return 0;
+}
+
+/**
+ * Function: osfs_write_inode
+ * Description: Copies the attributes the VFS keeps only in the in-memory inode,
+ *              such as the timestamps, back to the inode table and marks the
+ *              inode for the next journal commit, so that a commit or
+ *              checkpoint saves them. Writeback calls it for dirty inodes, and
+ *              sync does so before osfs_sync_fs. The copy is made between
+ *              osfs_meta_begin and osfs_meta_end, so a commit never saves
+ *              half of it; mark_inode_dirty must therefore not be called
+ *              inside such a section.
+ * Inputs:
+ *   - inode: The dirty inode.
+ *   - wbc: The writeback control, unused.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+
+    if (!osfs_inode)
+        return 0;
+    // commit 和 checkpoint 在 ckpt_sem 的 exclusive lock 下讀這些欄位，不能只複製一半
+    osfs_meta_begin(sb_info);
+    osfs_inode->i_mode = inode->i_mode;
+    osfs_inode->i_uid = i_uid_read(inode);
+    osfs_inode->i_gid = i_gid_read(inode);
+    osfs_inode->__i_atime = inode_get_atime(inode);
+    osfs_inode->__i_mtime = inode_get_mtime(inode);
+    osfs_inode->__i_ctime = inode_get_ctime(inode);
+    osfs_image_dirty_inode(sb_info, inode->i_ino);
+    osfs_meta_end(sb_info);
+    return 0;
+}
+
+/**
+ * Function: osfs_dirty_inode
+ * Description: Called when an inode is marked dirty, right after the change
+ *              that dirtied it. Copies the attributes to the inode table at
+ *              once, so the next journal commit logs them together with that
+ *              change instead of waiting for writeback.
+ * Inputs:
+ *   - inode: The inode being marked dirty.
+ *   - flags: The I_DIRTY_* flags being set, unused.
+ * Returns:
+ *   - None.
+ */
+static void osfs_dirty_inode(struct inode *inode, int flags)
+{
+    osfs_write_inode(inode, NULL);
+}
+
+/**
+ * Function: osfs_sync_fs
+ * Description: Writes a checkpoint to the image, if the mount has one.
+ *              The VFS calls it twice per sync, and once more at unmount with
+ *              wait set; only the waiting call checkpoints, after the VFS has
+ *              written back dirty pages and inodes.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - wait: Whether this is the waiting pass.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from osfs_image_save on failure.
+ */
+static int osfs_sync_fs(struct super_block *sb, int wait)
+{
+    if (!wait || sb_rdonly(sb))
+        return 0;
+    return osfs_image_save(sb->s_fs_info);
+}
+
 /**
  * Struct: osfs_super_ops
  * Description: Defines the superblock operations for the osfs filesystem.
  */
 const struct super_operations osfs_super_ops = {
-    .statfs = simple_statfs,            // Provides filesystem statistics
-    .drop_inode = generic_delete_inode, // Generic inode deletion
-    .destroy_inode = osfs_destroy_inode,
-
+    .statfs = osfs_statfs,              // Capacity and free space from the allocators
+    // drop_inode 用預設的 generic_drop_inode：沒人用的 inode 留在 cache 裡，刪掉的才立刻 evict
+    .alloc_inode = osfs_alloc_inode,
+    .free_inode = osfs_free_inode,
+    .evict_inode = osfs_evict_inode,
+    .dirty_inode = osfs_dirty_inode,    // Attributes to the inode table and the journal
+    .write_inode = osfs_write_inode,    // Timestamps back to the inode table
+    .sync_fs = osfs_sync_fs,            // Checkpoint to the image= backing file
 };
 
-void osfs_destroy_inode(struct inode *inode)
+/**
+ * Function: osfs_evict_inode
+ * Description: Releases the page cache of an inode that is leaving memory.
+ *              An inode with no links left is deleted: its data blocks and
+ *              inode number go back to the allocators.
+ * Inputs:
+ *   - inode: The inode being evicted.
+ * Returns:
+ *   - None.
+ */
+void osfs_evict_inode(struct inode *inode)
 {
-    if (inode->i_private) {
-        inode->i_private = NULL;
-    }
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->i_raw;
+    bool deleted = !inode->i_nlink && osfs_inode;
+
+    // 還沒寫回 data block 的 dirty page 要先寫回，否則丟掉 page cache 資料就不見了
+    if (S_ISREG(inode->i_mode) && !deleted)
+        filemap_write_and_wait(&inode->i_data);
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+    // index 只是目錄 block 的快取，下次 iget 時再重建
+    osfs_dir_index_destroy(OSFS_I(inode)->i_dir_index);
+    OSFS_I(inode)->i_dir_index = NULL;
+    if (deleted)
+        osfs_release_inode(inode->i_sb->s_fs_info, osfs_inode);
 }
 
 
 /**
  * Function: osfs_fill_super
  * Description: Initializes the superblock with filesystem-specific information during mount.
+ *              The inode table, bitmaps and data pool are sized from the mount options,
+ *              or from the backing image when image= names an existing one. When
+ *              mounted from a block device, the device holds the image; a new
+ *              one is sized to the device.
  * Inputs:
  *   - sb: The superblock to be filled.
- *   - data: Data passed during mount.
- *   - silent: If non-zero, suppress certain error messages.
+ *   - fc: The filesystem context carrying the parsed mount options.
  * Returns:
  *   - 0 on successful initialization.
  *   - A negative error code on failure.
  */
-int osfs_fill_super(struct super_block *sb, void *data, int silent)
+int osfs_fill_super(struct super_block *sb, struct fs_context *fc)
 {
     pr_info("osfs: Filling super start\n");
+    struct osfs_mount_opts *opts = fc->fs_private;
     struct inode *root_inode;
     struct osfs_sb_info *sb_info;
-    void *memory_region;
-    size_t total_memory_size;
-
-    // Calculate total memory size required
-    total_memory_size = sizeof(struct osfs_sb_info) +
-                        INODE_BITMAP_SIZE * sizeof(unsigned long) +
-                        BLOCK_BITMAP_SIZE * sizeof(unsigned long) +
-                        INODE_COUNT * sizeof(struct osfs_inode) +
-                        DATA_BLOCK_COUNT * BLOCK_SIZE;
-
-    // Allocate memory for superblock information and related structures
-    memory_region = vmalloc(total_memory_size);
-    if (!memory_region)
-        return -ENOMEM;
+    struct osfs_inode *root_osfs_inode;
+    int ret;
 
-    memset(memory_region, 0, total_memory_size);
+    sb_info = kzalloc(sizeof(*sb_info), GFP_KERNEL);
+    if (!sb_info)
+        return -ENOMEM;
 
     // Initialize superblock information
-    sb_info = (struct osfs_sb_info *)memory_region;
     sb_info->magic = OSFS_MAGIC;
-    sb_info->block_size = BLOCK_SIZE;
-    sb_info->inode_count = INODE_COUNT;
-    sb_info->block_count = DATA_BLOCK_COUNT;
-    sb_info->nr_free_inodes = INODE_COUNT - 1;
-    sb_info->nr_free_blocks = DATA_BLOCK_COUNT;
-
-    // Partition the memory region into respective components
-    sb_info->inode_bitmap = (unsigned long *)(sb_info + 1);
-    sb_info->block_bitmap = sb_info->inode_bitmap + INODE_BITMAP_SIZE;
-    sb_info->inode_table = (void *)(sb_info->block_bitmap + BLOCK_BITMAP_SIZE);
-    sb_info->data_blocks = (void *)((char *)sb_info->inode_table +
-                                    INODE_COUNT * sizeof(struct osfs_inode));
-
-    // Initialize bitmaps
-    memset(sb_info->inode_bitmap, 0, INODE_BITMAP_SIZE * sizeof(unsigned long));
-    memset(sb_info->block_bitmap, 0, BLOCK_BITMAP_SIZE * sizeof(unsigned long));
-
-    // Set superblock fields
+    sb_info->block_size = opts->block_size;
+    sb_info->inode_count = opts->inode_count;
+    sb_info->block_count = div_u64(opts->size, opts->block_size);
+    xa_init(&sb_info->data_pool);
+    init_rwsem(&sb_info->ckpt_sem);
+
+    // Set superblock fields. From here on osfs_kill_superblock cleans up on failure.
     sb->s_magic = sb_info->magic;
     sb->s_fs_info = sb_info;
+    sb_info->bdev = sb->s_bdev;
+    sb_info->sb = sb;
+
+    // 有 image 或掛在裝置上的話，大小以上面記錄的為準
+    if (sb_info->bdev) {
+        ret = osfs_image_open(sb_info, fc->source, opts->format);
+        if (ret)
+            return ret;
+        // 裝置的 block size 要和資料 block 一致，buffer head 才對得上
+        if (!sb_set_blocksize(sb, sb_info->block_size))
+            return -EINVAL;
+    } else if (opts->image) {
+        ret = osfs_image_open(sb_info, opts->image, false);
+        if (ret)
+            return ret;
+    }
     sb->s_op = &osfs_super_ops;
+    sb->s_blocksize = sb_info->block_size;
+    sb->s_blocksize_bits = ilog2(sb_info->block_size);
+    // 檔案大小只受限於 32-bit 的 logical block 編號，超過由 VFS 回 -EFBIG；
+    // 最後一個編號 U32_MAX 不給用，block 範圍的結尾才放得進 32 bits
+    sb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE,
+                           (loff_t)U32_MAX << sb->s_blocksize_bits);
+
+    // Set up the allocators and the inode table. Data blocks are not part of it:
+    // they come from the data pool when osfs_alloc_data_block needs them.
+    ret = osfs_allocator_init(&sb_info->inode_alloc, ROOT_INODE, sb_info->inode_count);
+    if (ret)
+        return ret;
+    ret = osfs_allocator_init(&sb_info->block_alloc, 0, sb_info->block_count);
+    if (ret)
+        return ret;
+    sb_info->inode_table = kvcalloc(sb_info->inode_count,
+                                    sizeof(struct osfs_inode), GFP_KERNEL);
+    if (!sb_info->inode_table)
+        return -ENOMEM;
+
+    // Block memory is aligned to the block size so a block never straddles a page
+    sb_info->block_cachep = kmem_cache_create("osfs_block", sb_info->block_size,
+                                              sb_info->block_size, 0, NULL);
+    if (!sb_info->block_cachep)
+        return -ENOMEM;
+
+    // 需要自己的 bdi，page cache 的 dirty page 才會被寫回 data block；
+    // 掛在裝置上時用裝置的 bdi
+    if (!sb_info->bdev) {
+        ret = super_setup_bdi(sb);
+        if (ret)
+            return ret;
+    }
+
+    // Restore an existing image; its root directory is then in the inode table
+    if (sb_info->image && sb_info->image->loaded) {
+        ret = osfs_image_load(sb_info);
+        if (ret)
+            return ret;
+        root_inode = osfs_iget(sb, ROOT_INODE);
+        if (IS_ERR(root_inode))
+            return PTR_ERR(root_inode);
+        goto make_root;
+    }
 
     // Create root directory inode
     root_inode = new_inode(sb);
-    if (!root_inode) {
-        vfree(memory_region);
+    if (!root_inode)
         return -ENOMEM;
-    }
 
     root_inode->i_ino = ROOT_INODE;
     root_inode->i_sb = sb;
@@ -94,35 +341,81 @@ int osfs_fill_super(struct super_block *sb, void *data, int silent)
     root_inode->i_mode = S_IFDIR | 0755;
     set_nlink(root_inode, 2);
     simple_inode_init_ts(root_inode);
-    
+
     // Initialize root directory's osfs_inode
-    struct osfs_inode *root_osfs_inode = osfs_get_osfs_inode(sb, ROOT_INODE);
+    root_osfs_inode = osfs_get_osfs_inode(sb, ROOT_INODE);
     if (!root_osfs_inode) {
         iput(root_inode);
-        vfree(memory_region);
         return -EIO;
     }
-    memset(root_osfs_inode, 0, sizeof(*root_osfs_inode));
-
-    root_osfs_inode->i_ino = ROOT_INODE;
+    osfs_init_osfs_inode(root_osfs_inode, ROOT_INODE);
     root_osfs_inode->i_mode = root_inode->i_mode;
     root_osfs_inode->i_links_count = 2;
     root_osfs_inode->__i_atime = root_osfs_inode->__i_mtime = root_osfs_inode->__i_ctime = current_time(root_inode);
-    root_inode->i_private = root_osfs_inode;
+    OSFS_I(root_inode)->i_raw = root_osfs_inode;
+    insert_inode_hash(root_inode);
 
     // Mark root directory inode as used
-    set_bit(ROOT_INODE, sb_info->inode_bitmap);
+    osfs_allocator_mark_used(&sb_info->inode_alloc, ROOT_INODE);
 
     // Update root directory size
     root_inode->i_size = 0;
     inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
+make_root:
     // Set the root directory
     sb->s_root = d_make_root(root_inode);
-    if (!sb->s_root) {
-        iput(root_inode);
-        vfree(memory_region);
+    if (!sb->s_root)
         return -ENOMEM;
-    }
+    // 掛載完成才開始 checkpoint，失敗的掛載不會覆蓋原本的 image
+    osfs_image_start(sb_info, opts->ckpt_interval, opts->commit_interval);
     pr_info("osfs: Superblock filled successfully \n");
     return 0;
 }
+
+/**
+ * Function: osfs_destroy_data_pool
+ * Description: Releases the memory of every data block still allocated and
+ *              the slab cache backing them.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+static void osfs_destroy_data_pool(struct osfs_sb_info *sb_info)
+{
+    unsigned long block_no;
+    void *block;
+
+    xa_for_each(&sb_info->data_pool, block_no, block)
+        kmem_cache_free(sb_info->block_cachep, block);
+    xa_destroy(&sb_info->data_pool);
+
+    kmem_cache_destroy(sb_info->block_cachep);
+    sb_info->block_cachep = NULL;
+}
+
+/**
+ * Function: osfs_free_sb_info
+ * Description: Frees the superblock information and everything it owns. Works
+ *              on a partially initialized sb_info left by a failed mount.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_free_sb_info(struct osfs_sb_info *sb_info)
+{
+    uint32_t ino;
+
+    osfs_image_close(sb_info);
+    // 釋放每個 inode 的 extent overflow tree；目錄的 hash index 已經在 evict 時釋放
+    if (sb_info->inode_table) {
+        for (ino = 0; ino < sb_info->inode_count; ino++)
+            osfs_extent_destroy(&((struct osfs_inode *)sb_info->inode_table)[ino]);
+    }
+    osfs_destroy_data_pool(sb_info);
+    kvfree(sb_info->inode_table);
+    osfs_allocator_destroy(&sb_info->block_alloc);
+    osfs_allocator_destroy(&sb_info->inode_alloc);
+    kfree(sb_info);
+}